@@ -18,104 +18,157 @@
 
 #include "snow.h"
 
-#include <string.h>
-
 
 /*
- * The Huffman codes.
+ * The Huffman codes as binary values, generated from huffcode.h
+ * when the program is built.
  */
 
-static const char	*huffcodes[256] = {
-#include "huffcode.h"
+typedef struct {
+	uint32_t	code;
+	int		len;
+} HUFF_CODE;
+
+static const HUFF_CODE	huffbin[256] = {
+#include "huffbin.h"
 };
 
 
 /*
- * Local variables used for compression.
+ * Initialize the compression routines.
  */
 
-static int		compress_bit_count;
-static int		compress_value;
-static unsigned long	compress_bits_in;
-static unsigned long	compress_bits_out;
+void
+compress_init (
+	SNOW_CTX	*ctx
+) {
+	ctx->compress_bit_count = 0;
+	ctx->compress_value = 0;
+	ctx->compress_acc = 0;
+	ctx->compress_acc_bits = 0;
+	ctx->compress_bits_in = 0;
+	ctx->compress_bits_out = 0;
+
+	encrypt_init (ctx);
+}
 
 
 /*
- * Initialize the compression routines.
+ * Return the number of bits a buffer of bytes takes up once it has
+ * been through the compression routines.
  */
 
-void
-compress_init (void)
-{
-	compress_bit_count = 0;
-	compress_value = 0;
-	compress_bits_in = 0;
-	compress_bits_out = 0;
-
-	encrypt_init ();
+unsigned long
+compress_size (
+	SNOW_CTX		*ctx,
+	const unsigned char	*buf,
+	size_t			n
+) {
+	unsigned long		bits = 0;
+	size_t			i;
+
+	if (!ctx->compress_flag)
+	    return (n * 8);
+
+	for (i=0; i<n; i++)
+	    bits += huffbin[buf[i]].len;
+
+	return (bits);
 }
 
 
 /*
- * Compress a single bit.
+ * Compress a buffer of bytes.
  */
 
 BOOL
-compress_bit (
-	int		bit,
-	FILE		*inf,
-	FILE		*outf
+compress_bytes (
+	SNOW_CTX	*ctx,
+	const unsigned char	*buf,
+	size_t			n,
+	SNOW_READER		*inf,
+	SNOW_WRITER		*outf
 ) {
-	if (!compress_flag)
-	    return (encrypt_bit (bit, inf, outf));
+	size_t			i;
 
-	compress_bits_in++;
-	compress_value = (compress_value << 1) | bit;
+	if (!ctx->compress_flag)
+	    return (encrypt_bytes (ctx, buf, n, inf, outf));
 
-	if (++compress_bit_count == 8) {
-	    const char	*s;
+	ctx->compress_bits_in += n * 8;
 
-	    for (s = huffcodes[compress_value]; *s != '\0'; s++) {
-		int	bit;
+	for (i=0; i<n; i++) {
+	    const HUFF_CODE	*hc = &huffbin[buf[i]];
 
-		if (*s == '1')
-		    bit = 1;
-		else if (*s == '0')
-		    bit = 0;
-		else {
-		    fprintf (stderr, "Illegal Huffman character '%c'\n", *s);
+	    if (ctx->compress_acc_bits + hc->len > 64) {
+		if (!encrypt_bits (ctx, ctx->compress_acc,
+					ctx->compress_acc_bits, inf, outf))
 		    return (FALSE);
-		}
 
-		if (!encrypt_bit (bit, inf, outf))
-		    return (FALSE);
-		compress_bits_out++;
+		ctx->compress_acc = 0;
+		ctx->compress_acc_bits = 0;
 	    }
 
-	    compress_value = 0;
-	    compress_bit_count = 0;
+	    ctx->compress_acc = (ctx->compress_acc << hc->len) | hc->code;
+	    ctx->compress_acc_bits += hc->len;
+	    ctx->compress_bits_out += hc->len;
 	}
 
 	return (TRUE);
 }
 
 
+/*
+ * Compress a single bit.
+ * Retained for compatibility - compress_bytes() is much faster.
+ */
+
+BOOL
+compress_bit (
+	SNOW_CTX	*ctx,
+	int		bit,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf
+) {
+	unsigned char	c;
+
+	if (!ctx->compress_flag)
+	    return (encrypt_bit (ctx, bit, inf, outf));
+
+	ctx->compress_value = (ctx->compress_value << 1) | bit;
+
+	if (++ctx->compress_bit_count < 8)
+	    return (TRUE);
+
+	c = ctx->compress_value;
+	ctx->compress_value = 0;
+	ctx->compress_bit_count = 0;
+
+	return (compress_bytes (ctx, &c, 1, inf, outf));
+}
+
+
 /*
  * Flush the contents of the compression routines.
  */
 
 BOOL
 compress_flush (
-	FILE		*inf,
-	FILE		*outf
+	SNOW_CTX	*ctx,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf
 ) {
-	if (compress_bit_count != 0 && !quiet_flag)
+	if (ctx->compress_bit_count != 0 && !ctx->quiet_flag)
 	    fprintf (stderr, "Warning: residual of %d bits not compressed\n",
-							compress_bit_count);
+							ctx->compress_bit_count);
 
-	if (compress_bits_out > 0 && !quiet_flag) {
-	    double	cpc = (double) (compress_bits_in - compress_bits_out)
-					/ (double) compress_bits_in * 100.0;
+	if (ctx->compress_acc_bits > 0
+		&& !encrypt_bits (ctx, ctx->compress_acc,
+					ctx->compress_acc_bits, inf, outf))
+	    return (FALSE);
+
+	if (ctx->compress_bits_out > 0 && !ctx->quiet_flag) {
+	    double	cpc = (double) (ctx->compress_bits_in - ctx->compress_bits_out)
+					/ (double) ctx->compress_bits_in * 100.0;
 
 	    if (cpc < 0.0)
 		fprintf (stderr,
@@ -125,49 +178,69 @@ compress_flush (
 		fprintf (stderr, "Compressed by %.2f%%\n", cpc);
 	}
 
-	return (encrypt_flush (inf, outf));
+	return (encrypt_flush (ctx, inf, outf));
 }
 
 
 /*
- * Local variables used for output.
+ * Initialize the output variables.
  */
 
-static int	output_bit_count;
-static int	output_value;
+static void
+output_init (
+	SNOW_CTX	*ctx
+) {
+	ctx->output_bit_count = 0;
+	ctx->output_value = 0;
+}
 
 
 /*
- * Initialize the output variables.
+ * Output a byte of data.
  */
 
-static void
-output_init (void)
-{
-	output_bit_count = 0;
-	output_value = 0;
+static BOOL
+output_byte (
+	int		c,
+	SNOW_WRITER	*outf
+) {
+	if (!writer_putc (outf, c)) {
+	    perror ("Output file");
+	    return (FALSE);
+	}
+
+	return (TRUE);
 }
 
 
 /*
- * Output a single bit.
+ * Output a number of bits, a byte at a time.
  */
 
 static BOOL
-output_bit (
-	int		bit,
-	FILE		*outf
+output_bits (
+	SNOW_CTX	*ctx,
+	uint64_t	bits,
+	int		nbits,
+	SNOW_WRITER	*outf
 ) {
-	output_value = (output_value << 1) | bit;
+	while (nbits > 0) {
+	    int		n = 8 - ctx->output_bit_count;
 
-	if (++output_bit_count == 8) {
-	    if (fputc (output_value, outf) == EOF) {
-		perror ("Output file");
-		return (FALSE);
-	    }
+	    if (n > nbits)
+		n = nbits;
+	    nbits -= n;
 
-	    output_value = 0;
-	    output_bit_count = 0;
+	    ctx->output_value = (ctx->output_value << n)
+				| (int) ((bits >> nbits) & ((1 << n) - 1));
+
+	    if ((ctx->output_bit_count += n) == 8) {
+		if (!output_byte (ctx->output_value, outf))
+		    return (FALSE);
+
+		ctx->output_value = 0;
+		ctx->output_bit_count = 0;
+	    }
 	}
 
 	return (TRUE);
@@ -180,22 +253,33 @@ output_bit (
 
 static BOOL
 output_flush (
-	FILE		*outf
+	SNOW_CTX	*ctx
 ) {
-	if (output_bit_count > 2 && !quiet_flag)
+	if (ctx->output_bit_count > 2 && !ctx->quiet_flag)
 	    fprintf (stderr, "Warning: residual of %d bits not output\n",
-							output_bit_count);
+							ctx->output_bit_count);
 
 	return (TRUE);
 }
 
 
 /*
- * Local variables used for uncompression.
+ * The Huffman decoding tables, generated from huffcode.h when the
+ * program is built.
+ * Codes are decoded 8 bits at a time. An entry with a non-zero length
+ * decodes a byte using that many bits of the index. Otherwise the value
+ * is the number of the table which decodes the following 8 bits, with
+ * zero (the root table) marking an invalid code.
  */
 
-static int	uncompress_bit_count;
-static char	uncompress_value[256];
+typedef struct {
+	unsigned char	len;
+	unsigned char	val;
+} HUFF_ENTRY;
+
+static const HUFF_ENTRY	huff_table[][256] = {
+#include "huffdec.h"
+};
 
 
 /*
@@ -203,68 +287,113 @@ static char	uncompress_value[256];
  */
 
 void
-uncompress_init (void)
-{
-	uncompress_bit_count = 0;
+uncompress_init (
+	SNOW_CTX	*ctx
+) {
+	ctx->uncompress_flag = ctx->compress_flag;
+	ctx->uncompress_acc = 0;
+	ctx->uncompress_acc_bits = 0;
 
-	output_init ();
+	output_init (ctx);
 }
 
 
 /*
- * Find the Huffman code string that matches.
+ * Decode as many whole bytes as possible from the accumulator.
  */
 
-static int
-huffcode_find (
-	const char	*str
+static BOOL
+uncompress_decode (
+	SNOW_CTX	*ctx,
+	SNOW_WRITER	*outf
 ) {
-	int		i;
+	for (;;) {
+	    int		t = 0, used = 0;
+	    const HUFF_ENTRY	*e;
+
+	    for (;;) {
+		int	avail = ctx->uncompress_acc_bits - used;
+		int	idx;
+
+		if (avail <= 0)
+		    return (TRUE);
+
+		if (avail >= 8)
+		    idx = (ctx->uncompress_acc >> (avail - 8)) & 0xff;
+		else
+		    idx = (ctx->uncompress_acc << (8 - avail)) & 0xff;
+
+		e = &huff_table[t][idx];
+		if (e->len != 0) {
+		    if (e->len > avail)
+			return (TRUE);
+		    used += e->len;
+		    break;
+		}
+
+		if (avail < 8)
+		    return (TRUE);
 
-	for (i=0; i<256; i++)
-	    if (strcmp (str, huffcodes[i]) == 0)
-		return (i);
+		if (e->val == 0) {
+		    fprintf (stderr, "Error: illegal Huffman code\n");
+		    return (FALSE);
+		}
+
+		used += 8;
+		t = e->val;
+	    }
+
+	    if (!output_byte (e->val, outf))
+		return (FALSE);
 
-	return (-1);
+	    ctx->uncompress_acc_bits -= used;
+	    ctx->uncompress_acc &= ((uint64_t) 1 << ctx->uncompress_acc_bits) - 1;
+	}
 }
 
 
 /*
- * Uncompress a single bit.
+ * Uncompress a number of bits.
  */
 
 BOOL
-uncompress_bit (
-	int		bit,
-	FILE		*outf
+uncompress_bits (
+	SNOW_CTX	*ctx,
+	uint64_t	bits,
+	int		nbits,
+	SNOW_WRITER	*outf
 ) {
-	int		code;
-
-	if (!compress_flag)
-	    return (output_bit (bit, outf));
+	if (!ctx->uncompress_flag)
+	    return (output_bits (ctx, bits, nbits, outf));
 
-	uncompress_value[uncompress_bit_count++] = bit ? '1' : '0';
-	uncompress_value[uncompress_bit_count] = '\0';
+	while (nbits > 0) {		/* Feed at most 32 bits at a time */
+	    int		n = (nbits > 32) ? 32 : nbits;
 
-	if ((code = huffcode_find (uncompress_value)) >= 0) {
-	    int		i;
+	    nbits -= n;
+	    ctx->uncompress_acc = (ctx->uncompress_acc << n)
+				| ((bits >> nbits) & (((uint64_t) 1 << n) - 1));
+	    ctx->uncompress_acc_bits += n;
 
-	    for (i=0; i<8; i++) {
-		int	b = ((code & (128 >> i)) != 0) ? 1 : 0;
+	    if (!uncompress_decode (ctx, outf))
+		return (FALSE);
+	}
 
-		if (!output_bit (b, outf))
-		    return (FALSE);
-	    }
+	return (TRUE);
+}
 
-	    uncompress_bit_count = 0;
-	}
 
-	if (uncompress_bit_count >= 255) {
-	    fprintf (stderr, "Error: Huffman uncompress buffer overflow\n");
-	    return (FALSE);
-	}
+/*
+ * Uncompress a single bit.
+ * Retained for compatibility - use uncompress_bits() instead.
+ */
 
-	return (TRUE);
+BOOL
+uncompress_bit (
+	SNOW_CTX	*ctx,
+	int		bit,
+	SNOW_WRITER	*outf
+) {
+	return (uncompress_bits (ctx, bit, 1, outf));
 }
 
 
@@ -274,11 +403,11 @@ uncompress_bit (
 
 BOOL
 uncompress_flush (
-	FILE		*outf
+	SNOW_CTX	*ctx
 ) {
-	if (uncompress_bit_count > 2 && !quiet_flag)
+	if (ctx->uncompress_acc_bits > 2 && !ctx->quiet_flag)
 	    fprintf (stderr, "Warning: residual of %d bits not uncompressed\n",
-							uncompress_bit_count);
+							ctx->uncompress_acc_bits);
 
-	return (output_flush (outf));
+	return (output_flush (ctx));
 }
@@ -16,6 +16,8 @@
  * For license text, see https://spdx.org/licenses/Apache-2.0>.
  */
 
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "snow.h"
@@ -23,46 +25,95 @@
 
 
 /*
- * The key to use for encryption/decryption.
+ * The optional stream header, which precedes the data when a cipher
+ * mode other than 1-bit CFB is used, or when a header is requested.
+ * It is always encrypted in 1-bit CFB mode, and holds a 32-bit magic
+ * number, an 8-bit version number and 8 bits of flags. Version 2
+ * headers add a 48-bit count of the data bits which follow, so
+ * extraction can stop at the end of the data. Version 3 headers also
+ * add a 24-bit line length, and the lines after the header use the
+ * dense encoding for that length. Version 4 headers also add a 32-bit
+ * chunk size in bytes and the 40-bit number of the first dense line,
+ * followed by an index entry for each chunk after the first, holding
+ * a 48-bit byte offset and a 24-bit bit count. When counter mode is
+ * used, 4 is added to the version, and a 66-bit field holding a random
+ * 64-bit nonce, where the counter starts, comes before any index. Every
+ * header is a whole number of 3-bit groups.
+ *
+ * A message with a length header is closed by a version 1 header with
+ * the end flag set, on the line after the data, encrypted carrying on
+ * from the last 64 bits of ciphertext. Appending a segment replaces it,
+ * and extraction stops at it, whatever follows.
  */
 
-static ICE_KEY		*ice_key = NULL;
-static unsigned char	encrypt_iv_block[8];
+#define HEADER_MAGIC		0x9e5e0f17UL
+#define HEADER_VERSION		1
+#define HEADER_VERSION_LEN	2
+#define HEADER_VERSION_DENSE	3
+#define HEADER_VERSION_INDEX	4
+#define HEADER_VERSION_NONCE	4	/* Added when there is a nonce */
+#define HEADER_BITS		48
+#define HEADER_LEN_BITS		48
+#define HEADER_LINE_BITS	24
+#define HEADER_CHUNK_BITS	32
+#define HEADER_START_BITS	40
+#define HEADER_NONCE_BITS	66
+#define HEADER_ENTRY_BITS	(HEADER_LEN_BITS + HEADER_LINE_BITS)
+#define HEADER_FIELDS		8
+
+			/* Where the parts of a header end */
+#define HEADER_LEN_END		(HEADER_BITS + HEADER_LEN_BITS)
+#define HEADER_LINE_END		(HEADER_LEN_END + HEADER_LINE_BITS)
+#define HEADER_CHUNK_END	(HEADER_LINE_END + HEADER_CHUNK_BITS)
+#define HEADER_INDEX_START	(HEADER_CHUNK_END + HEADER_START_BITS)
+
+#define HEADER_CTR		0x01	/* Data uses counter mode */
+#define HEADER_COMPRESS		0x02	/* Data is compressed */
+#define HEADER_ZW		0x04	/* Dense lines end in zero-width */
+#define HEADER_EOL		0x08	/* Dense lines end in CRLF or LF */
+#define HEADER_NO_WS		0x10	/* Dense lines have no whitespace */
+#define HEADER_END		0x20	/* No segment follows */
 
 
 /*
- * Build the ICE key from the supplied password.
- * Only uses the lower 7 bits from each character.
+ * Information shared by the parallel decryption threads.
  */
 
-void
-password_set (
-	const char	*passwd
+typedef struct {
+	const ICE_KEY		*ik;
+	const unsigned char	*ctext;
+	unsigned char		*ptext;
+	unsigned long		nbits;
+	uint64_t		iv;
+	int			mode;
+	int			nthreads;
+} DECRYPT_JOB;
+
+
+/*
+ * Pack the password into a key buffer, as done by the original key
+ * setup. Only uses the lower 7 bits from each character, and the ICE
+ * level grows with the password length. Returns the ICE level.
+ */
+
+static int
+password_pack (
+	SNOW_CTX	*ctx,
+	const char	*passwd,
+	unsigned char	*buf
 ) {
 	int		i, level;
-	unsigned char	buf[1024];
 
 	level = (strlen (passwd) * 7 + 63) / 64;
 
 	if (level == 0) {
-	    if (!quiet_flag)
-		fprintf (stderr, "Warning: an empty password is being used\n");
 	    level = 1;
 	} else if (level > 128) {
-	    if (!quiet_flag)
+	    if (!ctx->quiet_flag)
 		fprintf (stderr, "Warning: password truncated to 1170 chars\n");
 	    level = 128;
 	}
 
-	if ((ice_key = ice_key_create (level)) == NULL) {
-	    if (!quiet_flag)
-		fprintf (stderr, "Warning: failed to set password\n");
-	    return;
-	}
-
-	for (i=0; i<1024; i++)
-	    buf[i] = 0;
-
 	i = 0;
 	while (*passwd != '\0') {
 	    unsigned char	c = *passwd & 0x7f;
@@ -85,127 +136,1470 @@ password_set (
 		break;
 	}
 
-	ice_key_set (ice_key, buf);
+	return (level);
+}
+
+
+/*
+ * Hash the password into 8 bytes, using ICE as the compression
+ * function of a Davies-Meyer hash. The password is padded with a
+ * 1 bit and its 32-bit length in bits, and the initial value includes
+ * the block number so that each 8 bytes of the derived key differ.
+ */
+
+static BOOL
+password_hash (
+	const char	*passwd,
+	int		blockno,
+	unsigned char	*hash
+) {
+	static const unsigned char	kdf_iv[8] = {
+				'S', 'N', 'O', 'W', 'K', 'D', 'F', '1'};
+	ICE_KEY		*ik;
+	size_t		len = strlen (passwd);
+	size_t		i, n = (len + 5 + 7) / 8 * 8;
+	unsigned long	bits = len * 8;
+
+	if ((ik = ice_key_create (1)) == NULL)
+	    return (FALSE);
+
+	for (i=0; i<8; i++)
+	    hash[i] = kdf_iv[i];
+	hash[6] ^= (blockno >> 8) & 0xff;
+	hash[7] ^= blockno & 0xff;
+
+	for (i=0; i<n; i += 8) {
+	    unsigned char	m[8], c[8];
+	    int			j;
+
+	    for (j=0; j<8; j++) {
+		size_t		k = i + j;
+
+		if (k < len)
+		    m[j] = passwd[k];
+		else if (k == len)
+		    m[j] = 0x80;
+		else if (k >= n - 4)
+		    m[j] = (bits >> ((n - 1 - k) * 8)) & 0xff;
+		else
+		    m[j] = 0;
+	    }
+
+	    ice_key_set (ik, m);
+	    ice_key_encrypt (ik, hash, c);
+
+	    for (j=0; j<8; j++)
+		hash[j] ^= c[j];
+	}
+
+	ice_key_destroy (ik);
+
+	return (TRUE);
+}
+
+
+/*
+ * Derive a key of the given ICE level from a password of any length.
+ * This is version 1 of the key derivation, used when an ICE level
+ * has been specified.
+ */
+
+static BOOL
+password_derive (
+	const char	*passwd,
+	int		level,
+	unsigned char	*buf
+) {
+	int		i;
+
+	if (level < 1)
+	    level = 1;
+
+	for (i=0; i<level; i++)
+	    if (!password_hash (passwd, i, &buf[i * 8]))
+		return (FALSE);
+
+	return (TRUE);
+}
+
+
+/*
+ * Build the ICE key from the supplied password.
+ */
+
+void
+password_set (
+	SNOW_CTX	*ctx,
+	const char	*passwd
+) {
+	int		i, level;
+	unsigned char	buf[1024];
+
+	if (*passwd == '\0' && !ctx->quiet_flag)
+	    fprintf (stderr, "Warning: an empty password is being used\n");
+
+	for (i=0; i<1024; i++)
+	    buf[i] = 0;
+
+	if (ctx->ice_key != NULL) {
+	    ice_key_destroy (ctx->ice_key);
+	    ctx->ice_key = NULL;
+	}
+
+	if (ctx->ice_level < 0) {
+	    level = password_pack (ctx, passwd, buf);
+	} else {
+	    level = ctx->ice_level;
+	    if (!password_derive (passwd, level, buf)) {
+		if (!ctx->quiet_flag)
+		    fprintf (stderr, "Warning: failed to set password\n");
+		return;
+	    }
+	}
+
+	if ((ctx->ice_key = ice_key_create (level)) == NULL) {
+	    if (!ctx->quiet_flag)
+		fprintf (stderr, "Warning: failed to set password\n");
+	    return;
+	}
+
+	ice_key_set (ctx->ice_key, buf);
 
 		/* Set the initialization vector with the key
 		 * with itself.
 		 */
-	ice_key_encrypt (ice_key, buf, encrypt_iv_block);
+	ice_key_encrypt (ctx->ice_key, buf, buf);
+
+	ctx->encrypt_iv = 0;
+	for (i=0; i<8; i++)
+	    ctx->encrypt_iv = (ctx->encrypt_iv << 8) | buf[i];
+	ctx->encrypt_iv_start = ctx->encrypt_iv;
 }
 
 
 /*
- * Initialize the encryption routines.
+ * Store a 64-bit value as a block of 8 bytes.
  */
 
-void
-encrypt_init (void)
-{
-	encode_init ();
+static void
+block_store (
+	uint64_t	x,
+	unsigned char	*buf
+) {
+	int		i;
+
+	for (i=0; i<8; i++)
+	    buf[i] = (x >> (56 - i * 8)) & 0xff;
 }
 
 
 /*
- * Encrypt a single bit.
+ * Encrypt a 64-bit value as a block.
  */
 
-BOOL
-encrypt_bit (
-	int		bit,
-	FILE		*inf,
-	FILE		*outf
+static uint64_t
+block_encrypt (
+	SNOW_CTX	*ctx,
+	uint64_t	x
 ) {
 	int		i;
 	unsigned char	buf[8];
 
-	if (ice_key == NULL)
-	    return (encode_bit (bit, inf, outf));
+	block_store (x, buf);
+	ice_key_encrypt (ctx->ice_key, buf, buf);
+
+	for (x = 0, i = 0; i < 8; i++)
+	    x = (x << 8) | buf[i];
+
+	return (x);
+}
+
+
+/*
+ * Return the next CFB keystream bit, which is the top bit of the
+ * encrypted IV.
+ */
+
+static int
+keystream_bit (
+	SNOW_CTX	*ctx
+) {
+	return ((block_encrypt (ctx, ctx->encrypt_iv) >> 63) & 1);
+}
+
+
+/*
+ * Return the next block of counter mode keystream.
+ */
+
+static uint64_t
+keystream_ctr_block (
+	SNOW_CTX	*ctx
+) {
+	int		i;
+	uint64_t	ks;
 
-	ice_key_encrypt (ice_key, encrypt_iv_block, buf);
-	if ((buf[0] & 128) != 0)
-	    bit = !bit;
+	if (ctx->encrypt_ks_next == CTR_BATCH) {
+	    for (i=0; i<CTR_BATCH; i++)
+		block_store (ctx->encrypt_ctr++, ctx->encrypt_ks_blocks[i]);
 
-			/* Rotate the IV block one bit left */
-	for (i=0; i<8; i++) {
-	    encrypt_iv_block[i] <<= 1;
-	    if (i < 7 && (encrypt_iv_block[i+1] & 128) != 0)
-		encrypt_iv_block[i] |= 1;
+	    ice_key_encrypt_blocks (ctx->ice_key, ctx->encrypt_ks_blocks[0],
+					ctx->encrypt_ks_blocks[0], CTR_BATCH);
+	    ctx->encrypt_ks_next = 0;
 	}
-	encrypt_iv_block[7] |= bit;
 
-	return (encode_bit (bit, inf, outf));
+	for (ks = 0, i = 0; i < 8; i++)
+	    ks = (ks << 8) | ctx->encrypt_ks_blocks[ctx->encrypt_ks_next][i];
+	ctx->encrypt_ks_next++;
+
+	return (ks);
 }
 
 
 /*
- * Flush the contents of the encryption routines.
+ * Return the next nbits of counter mode keystream.
  */
 
-BOOL
-encrypt_flush (
-	FILE		*inf,
-	FILE		*outf
+static uint64_t
+keystream_ctr (
+	SNOW_CTX	*ctx,
+	int		nbits
 ) {
-	ice_key_destroy (ice_key);
+	uint64_t	ks = 0;
+
+	while (nbits > 0) {
+	    int		n;
+
+	    if (ctx->encrypt_ks_bits == 0) {
+		ctx->encrypt_ks = keystream_ctr_block (ctx);
+		ctx->encrypt_ks_bits = 64;
+	    }
+
+	    n = (nbits < ctx->encrypt_ks_bits) ? nbits : ctx->encrypt_ks_bits;
+	    nbits -= n;
+	    ctx->encrypt_ks_bits -= n;
 
-	return (encode_flush (inf, outf));
+	    ks = (n == 64) ? ctx->encrypt_ks : (ks << n)
+		| ((ctx->encrypt_ks >> ctx->encrypt_ks_bits) & (((uint64_t) 1 << n) - 1));
+	}
+
+	return (ks);
 }
 
 
 /*
- * Initialize the decryption routines.
+ * Switch from 1-bit CFB to the selected cipher mode.
+ */
+
+static void
+cipher_mode_start (
+	SNOW_CTX	*ctx,
+	int		mode
+) {
+	ctx->encrypt_mode = mode;
+	ctx->encrypt_ctr = ctx->encrypt_iv;
+	ctx->encrypt_ks_bits = 0;
+	ctx->encrypt_ks_next = CTR_BATCH;
+}
+
+
+/*
+ * Decrypt one thread's share of the collected ciphertext, 64 bits
+ * at a time. In 1-bit CFB mode the IV for each bit is the previous
+ * 64 bits of ciphertext, so the shares can be processed independently.
+ * The blocks needed for each batch of bits are encrypted together.
+ * Counter mode is its own inverse, so this encrypts in that mode too.
+ */
+
+static void
+decrypt_range (
+	void		*arg,
+	int		idx
+) {
+	const DECRYPT_JOB	*job = (const DECRYPT_JOB *) arg;
+	unsigned long		nbytes = (job->nbits + 7) / 8;
+	unsigned long		nwords = (job->nbits + 63) / 64;
+	unsigned long		w = nwords * idx / job->nthreads;
+	unsigned long		wend = nwords * (idx + 1) / job->nthreads;
+	unsigned char		blocks[CTR_BATCH][8];
+	uint64_t		iv;
+	int			i;
+
+	if (job->mode == CIPHER_CTR) {
+	    while (w < wend) {
+		int		n = (wend - w < CTR_BATCH) ? wend - w : CTR_BATCH;
+		unsigned long	j;
+
+		for (i=0; i<n; i++)
+		    block_store (job->iv + w + i, blocks[i]);
+		ice_key_encrypt_blocks (job->ik, blocks[0], blocks[0], n);
+
+		for (j = w * 8; j < (w + n) * 8 && j < nbytes; j++)
+		    job->ptext[j] = job->ctext[j] ^ blocks[0][j - w * 8];
+		w += n;
+	    }
+
+	    return;
+	}
+
+	if (w == 0)
+	    iv = job->iv;
+	else
+	    for (iv = 0, i = 0; i < 8; i++)
+		iv = (iv << 8) | job->ctext[w * 8 - 8 + i];
+
+	for (; w < wend; w++) {
+	    uint64_t		c = 0, p;
+	    int			n, nb;
+
+	    n = (job->nbits - w * 64 < 64) ? job->nbits - w * 64 : 64;
+	    nb = (n + 7) / 8;
+
+	    for (i=0; i<nb; i++)
+		c |= (uint64_t) job->ctext[w * 8 + i] << (56 - i * 8);
+
+	    for (i=0; i<n; i++) {
+		block_store (iv, blocks[i]);
+		iv = (iv << 1) | (c >> (63 - i) & 1);
+	    }
+
+	    ice_key_encrypt_blocks (job->ik, blocks[0], blocks[0], n);
+
+	    for (p = c, i = 0; i < n; i++)
+		if ((blocks[i][0] & 128) != 0)
+		    p ^= (uint64_t) 1 << (63 - i);
+
+	    for (i=0; i<nb; i++)
+		job->ptext[w * 8 + i] = (p >> (56 - i * 8)) & 0xff;
+	}
+}
+
+
+/*
+ * Limit a number of decryption threads so each has at least 4096 bits
+ * of the nbytes to work on.
+ */
+
+static int
+decrypt_threads (
+	int		n,
+	unsigned long	nbytes
+) {
+	if ((unsigned long) n > nbytes / 512 + 1)
+	    n = (int) (nbytes / 512 + 1);
+
+	return (n);
+}
+
+
+/*
+ * Return whether the header holds the data length. The dense encoding
+ * needs it, since a line's worth of padding could hold whole bytes.
+ */
+
+static BOOL
+header_has_length (
+	SNOW_CTX	*ctx
+) {
+	return (ctx->header_flag || dense_used (ctx));
+}
+
+
+/*
+ * Return the cipher mode used to conceal. A chunk index needs counter
+ * mode, whatever the context was set to.
+ */
+
+int
+cipher_mode_used (
+	SNOW_CTX	*ctx
+) {
+	return ((ctx->chunk_size > 0) ? CIPHER_CTR : ctx->cipher_mode);
+}
+
+
+/*
+ * Initialize the encryption routines.
  */
 
 void
-decrypt_init (void)
-{
-	uncompress_init ();
+encrypt_init (
+	SNOW_CTX	*ctx
+) {
+	ctx->encrypt_iv = ctx->encrypt_iv_start;
+	ctx->encrypt_tail = ctx->encrypt_iv_start;
+	ctx->encrypt_mode = CIPHER_CFB;
+	ctx->encrypt_header_pending = (cipher_mode_used (ctx) != CIPHER_CFB
+						|| header_has_length (ctx));
+	ctx->encrypt_hold_bits = 0;
+	ctx->index_count = 0;
+	ctx->index_line = 0;
+
+	encode_init (ctx);
 }
 
 
 /*
- * Decrypt a single bit.
+ * Return the number of chunk index entries for a message of the given
+ * number of bits, one for each chunk after the first.
+ */
+
+static uint64_t
+index_entries (
+	unsigned long	chunk,
+	uint64_t	bits
+) {
+	return ((bits > 0) ? (bits - 1) / ((uint64_t) chunk * 8) : 0);
+}
+
+
+/*
+ * Add an entry to the chunk index. Returns FALSE if out of memory.
  */
 
 BOOL
-decrypt_bit (
-	int		bit,
-	FILE		*outf
+index_append (
+	SNOW_CTX	*ctx,
+	uint64_t	offset,
+	unsigned long	bits
 ) {
-	int		i;
-	int		nbit;
+	if (ctx->index_count == ctx->index_size) {
+	    unsigned long	size = ctx->index_size * 2 + 64;
+	    SNOW_CHUNK		*p;
+
+	    if ((p = (SNOW_CHUNK *) realloc (ctx->index,
+					size * sizeof (SNOW_CHUNK))) == NULL) {
+		fprintf (stderr, "Error: out of memory\n");
+		return (FALSE);
+	    }
+
+	    ctx->index = p;
+	    ctx->index_size = size;
+	}
+
+	ctx->index[ctx->index_count].offset = offset;
+	ctx->index[ctx->index_count].bits = bits;
+	ctx->index_count++;
+
+	return (TRUE);
+}
+
+
+/*
+ * Return the number of bits of header written before the data.
+ */
+
+int
+encrypt_header_size (
+	SNOW_CTX	*ctx
+) {
+	int		n;
+
+	if (cipher_mode_used (ctx) == CIPHER_CFB && !header_has_length (ctx))
+	    return (0);
+
+	n = HEADER_BITS + (header_has_length (ctx) ? HEADER_LEN_BITS : 0)
+			+ (dense_used (ctx) ? HEADER_LINE_BITS : 0);
+
+	if (cipher_mode_used (ctx) == CIPHER_CTR)
+	    n += HEADER_NONCE_BITS;
+
+	if (ctx->chunk_size > 0)
+	    n += HEADER_CHUNK_BITS + HEADER_START_BITS + HEADER_ENTRY_BITS
+		* (int) index_entries (ctx->chunk_size, ctx->encrypt_hold_bits);
+
+	return (n);
+}
+
+
+/*
+ * Choose a random nonce for counter mode, so that no two messages use
+ * the same keystream, even with the same password. They are read
+ * from /dev/urandom, which only unix systems are assumed to have.
+ * Returns FALSE if no random numbers are available.
+ */
+
+static BOOL
+nonce_make (
+	SNOW_CTX	*ctx
+) {
+#ifdef unix
+	FILE		*fp;
 	unsigned char	buf[8];
+	int		i;
 
-	if (ice_key == NULL)
-	    return (uncompress_bit (bit, outf));
+	if ((fp = fopen ("/dev/urandom", "rb")) == NULL) {
+	    perror ("/dev/urandom");
+	    return (FALSE);
+	}
 
-	ice_key_encrypt (ice_key, encrypt_iv_block, buf);
-	if ((buf[0] & 128) != 0)
-	    nbit = !bit;
-	else
-	    nbit = bit;
+	if (fread (buf, 1, sizeof (buf), fp) != sizeof (buf)) {
+	    fprintf (stderr, "Error: can't read a nonce from /dev/urandom\n");
+	    fclose (fp);
+	    return (FALSE);
+	}
+
+	fclose (fp);
+
+	ctx->encrypt_nonce = 0;
+	for (i=0; i<8; i++)
+	    ctx->encrypt_nonce = (ctx->encrypt_nonce << 8) | buf[i];
+
+	return (TRUE);
+#else
+	ctx->encrypt_nonce = 0;
+	fprintf (stderr,
+		"Error: no source of random numbers for counter mode.\n");
+	return (FALSE);
+#endif
+}
+
+
+/*
+ * Encrypt bits in 1-bit CFB mode, one at a time.
+ */
+
+static uint64_t
+cfb_encrypt (
+	SNOW_CTX	*ctx,
+	uint64_t	bits,
+	int		nbits
+) {
+	int		i;
+	uint64_t	out = 0;
+
+	for (i = nbits - 1; i >= 0; i--) {
+	    int		bit = ((bits >> i) & 1) ^ keystream_bit (ctx);
 
-			/* Rotate the IV block one bit left */
-	for (i=0; i<8; i++) {
-	    encrypt_iv_block[i] <<= 1;
-	    if (i < 7 && (encrypt_iv_block[i+1] & 128) != 0)
-		encrypt_iv_block[i] |= 1;
+	    ctx->encrypt_iv = (ctx->encrypt_iv << 1) | bit;
+	    out = (out << 1) | bit;
 	}
-	encrypt_iv_block[7] |= bit;
 
-	return (uncompress_bit (nbit, outf));
+	return (out);
 }
 
 
 /*
- * Flush the contents of the decryption routines.
+ * Keep the last 64 bits of ciphertext written, which the header after
+ * the end of the data is encrypted from.
  */
 
-BOOL
-decrypt_flush (
-	FILE		*outf
+static void
+tail_add (
+	SNOW_CTX	*ctx,
+	uint64_t	bits,
+	int		nbits
+) {
+	if (nbits == 0)
+	    return;
+
+	bits &= ((uint64_t) 2 << (nbits - 1)) - 1;
+	ctx->encrypt_tail = (nbits < 64) ? (ctx->encrypt_tail << nbits) | bits
+								: bits;
+}
+
+
+/*
+ * Keep the last 64 bits of a buffer of nbits of ciphertext, which has
+ * been encoded straight from the buffer.
+ */
+
+static void
+tail_add_buffer (
+	SNOW_CTX	*ctx,
+	const unsigned char	*buf,
+	unsigned long	nbits
+) {
+	unsigned long	i = (nbits > 64) ? (nbits - 64) / 8 * 8 : 0;
+
+	for (; i < nbits; i += 64) {
+	    int		n = (nbits - i < 64) ? nbits - i : 64;
+
+	    tail_add (ctx, bitbuf_get (buf, i, n), n);
+	}
+}
+
+
+/*
+ * Encrypt bits in the current cipher mode, and pass them on to the
+ * encoder.
+ */
+
+static BOOL
+encrypt_data (
+	SNOW_CTX	*ctx,
+	uint64_t	bits,
+	int		nbits,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf
+) {
+	if (ctx->ice_key != NULL && ctx->encrypt_mode == CIPHER_CTR)
+	    bits ^= keystream_ctr (ctx, nbits);
+	else if (ctx->ice_key != NULL)
+	    bits = cfb_encrypt (ctx, bits, nbits);
+
+	tail_add (ctx, bits, nbits);
+
+	return (encode_bits (ctx, bits, nbits, inf, outf));
+}
+
+
+/*
+ * Fill in the fields of the stream header that come before any chunk
+ * index, returning how many there are.
+ */
+
+static int
+header_fields (
+	SNOW_CTX	*ctx,
+	uint64_t	*val,
+	int		*nbits
 ) {
-	ice_key_destroy (ice_key);
+	uint64_t	hdr = HEADER_MAGIC;
+	int		version = HEADER_VERSION;
+	int		flags = 0;
+	int		n = 0;
+
+	if (ctx->chunk_size > 0)
+	    version = HEADER_VERSION_INDEX;
+	else if (dense_used (ctx))
+	    version = HEADER_VERSION_DENSE;
+	else if (ctx->header_flag)
+	    version = HEADER_VERSION_LEN;
+
+	if (cipher_mode_used (ctx) == CIPHER_CTR) {
+	    version += HEADER_VERSION_NONCE;
+	    flags |= HEADER_CTR;
+	}
+	if (header_has_length (ctx) && ctx->compress_flag)
+	    flags |= HEADER_COMPRESS;
+	if ((ctx->carriers & CARRIER_ZW) != 0)
+	    flags |= HEADER_ZW;
+	if ((ctx->carriers & CARRIER_EOL) != 0)
+	    flags |= HEADER_EOL;
+	if ((ctx->carriers & CARRIER_WS) == 0)
+	    flags |= HEADER_NO_WS;
+
+	val[n] = (hdr << 16) | (version << 8) | flags;
+	nbits[n++] = HEADER_BITS;
+
+	if (header_has_length (ctx)) {
+	    val[n] = ctx->encrypt_hold_bits;
+	    nbits[n++] = HEADER_LEN_BITS;
+	}
+
+	if (dense_used (ctx)) {
+	    val[n] = ctx->line_length;
+	    nbits[n++] = HEADER_LINE_BITS;
+	}
+
+	if (ctx->chunk_size > 0) {
+	    val[n] = ctx->chunk_size;
+	    nbits[n++] = HEADER_CHUNK_BITS;
+	    val[n] = ctx->index_line;
+	    nbits[n++] = HEADER_START_BITS;
+	}
+
+	if (cipher_mode_used (ctx) == CIPHER_CTR) {
+	    val[n] = 0;
+	    nbits[n++] = HEADER_NONCE_BITS - 64;
+	    val[n] = ctx->encrypt_nonce;
+	    nbits[n++] = 64;
+	}
+
+	return (n);
+}
+
+
+/*
+ * Write the stream header, then switch to the selected cipher mode,
+ * and to the dense encoding if it is used. Counter mode starts at the
+ * nonce, which with a chunk index encrypt_hold_indexed() has chosen.
+ */
+
+BOOL
+encrypt_header (
+	SNOW_CTX	*ctx,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf
+) {
+	uint64_t	val[HEADER_FIELDS];
+	int		nbits[HEADER_FIELDS];
+	int		i, n;
+	unsigned long	j;
+
+	if (cipher_mode_used (ctx) == CIPHER_CTR && ctx->chunk_size == 0
+						&& !nonce_make (ctx))
+	    return (FALSE);
+
+	n = header_fields (ctx, val, nbits);
+	ctx->encrypt_header_pending = FALSE;
+	for (i=0; i<n; i++)
+	    if (!encrypt_data (ctx, val[i], nbits[i], inf, outf))
+		return (FALSE);
+
+	for (j=0; j<ctx->index_count; j++)
+	    if (!encrypt_data (ctx, ctx->index[j].offset, HEADER_LEN_BITS,
+								inf, outf)
+		    || !encrypt_data (ctx, ctx->index[j].bits,
+					HEADER_LINE_BITS, inf, outf))
+		return (FALSE);
+
+	if (cipher_mode_used (ctx) == CIPHER_CTR)
+	    ctx->encrypt_iv = ctx->encrypt_nonce;
+	cipher_mode_start (ctx, cipher_mode_used (ctx));
+
+	return (!dense_used (ctx) || encode_dense_start (ctx, outf));
+}
+
+
+/*
+ * Encrypt a number of bits, passing the result on to the encoder.
+ * If the header holds the data length, the data is held back until
+ * encrypt_flush() is called.
+ */
+
+BOOL
+encrypt_bits (
+	SNOW_CTX	*ctx,
+	uint64_t	bits,
+	int		nbits,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf
+) {
+	if (header_has_length (ctx)) {
+	    if (!bitbuf_append (&ctx->encrypt_hold, &ctx->encrypt_hold_size,
+					&ctx->encrypt_hold_bits, bits, nbits)) {
+		fprintf (stderr, "Error: out of memory\n");
+		return (FALSE);
+	    }
+
+	    return (TRUE);
+	}
+
+	if (ctx->encrypt_header_pending && !encrypt_header (ctx, inf, outf))
+	    return (FALSE);
+
+	return (encrypt_data (ctx, bits, nbits, inf, outf));
+}
+
+
+/*
+ * Encrypt a buffer of bytes, a 64-bit word at a time.
+ */
+
+BOOL
+encrypt_bytes (
+	SNOW_CTX	*ctx,
+	const unsigned char	*buf,
+	size_t			n,
+	SNOW_READER		*inf,
+	SNOW_WRITER		*outf
+) {
+	while (n > 0) {
+	    int		i, len = (n < 8) ? n : 8;
+	    uint64_t	bits = 0;
+
+	    for (i=0; i<len; i++)
+		bits = (bits << 8) | buf[i];
+
+	    if (!encrypt_bits (ctx, bits, len * 8, inf, outf))
+		return (FALSE);
+
+	    buf += len;
+	    n -= len;
+	}
+
+	return (TRUE);
+}
+
+
+/*
+ * Encrypt a single bit.
+ * Retained for compatibility - encrypt_bytes() is much faster.
+ */
+
+BOOL
+encrypt_bit (
+	SNOW_CTX	*ctx,
+	int		bit,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf
+) {
+	return (encrypt_bits (ctx, bit, 1, inf, outf));
+}
+
+
+/*
+ * Encrypt the held data all at once, then have the encoder spread it
+ * over the text with the threads given. In counter mode the keystream
+ * is made in parallel too, and the counter is left after the blocks it
+ * used, while 1-bit CFB has to go a bit at a time.
+ */
+
+static BOOL
+encrypt_hold_parallel (
+	SNOW_CTX	*ctx,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf
+) {
+	unsigned long	nbits = ctx->encrypt_hold_bits;
+	unsigned long	nbytes = (nbits + 7) / 8;
+	unsigned long	size = nbytes + 1, used = 0, i;
+	unsigned char	*ctext;
+	DECRYPT_JOB	job;
+	BOOL		ok;
+
+	if (ctx->ice_key == NULL) {
+	    tail_add_buffer (ctx, ctx->encrypt_hold, nbits);
+	    return (encode_dense_parallel (ctx, ctx->encrypt_hold, nbits,
+						inf, outf, ctx->threads));
+	}
+
+	if ((ctext = (unsigned char *) calloc (size, 1)) == NULL) {
+	    fprintf (stderr, "Error: out of memory\n");
+	    return (FALSE);
+	}
+
+	if (ctx->encrypt_mode == CIPHER_CTR) {
+	    job.ik = ctx->ice_key;
+	    job.ctext = ctx->encrypt_hold;
+	    job.ptext = ctext;
+	    job.nbits = nbits;
+	    job.iv = ctx->encrypt_ctr;
+	    job.mode = CIPHER_CTR;
+	    job.nthreads = decrypt_threads (ctx->threads, nbytes);
+
+	    parallel_run (job.nthreads, decrypt_range, &job);
+	    ctx->encrypt_ctr += (nbits + 63) / 64;
+	} else {
+	    for (i = 0; i < nbits; i += 64) {
+		int	n = (nbits - i < 64) ? nbits - i : 64;
+
+		if (!bitbuf_append (&ctext, &size, &used, cfb_encrypt (ctx,
+				bitbuf_get (ctx->encrypt_hold, i, n), n), n)) {
+		    fprintf (stderr, "Error: out of memory\n");
+		    free (ctext);
+		    return (FALSE);
+		}
+	    }
+	}
+
+	tail_add_buffer (ctx, ctext, nbits);
+	ok = encode_dense_parallel (ctx, ctext, nbits, inf, outf,
+								ctx->threads);
+	free (ctext);
+
+	return (ok);
+}
+
+
+/*
+ * Encrypt the held data for a message with a chunk index, then have
+ * the encoder lay it out and write the header. Counter mode starts at
+ * the nonce, so the data is encrypted before the rest of the header is
+ * known, and each chunk can be decrypted without the ones before it.
+ */
+
+static BOOL
+encrypt_hold_indexed (
+	SNOW_CTX	*ctx,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf
+) {
+	unsigned long	nbytes = (ctx->encrypt_hold_bits + 7) / 8;
+	DECRYPT_JOB	job;
+	BOOL		ok;
+
+	if (index_entries (ctx->chunk_size, ctx->encrypt_hold_bits)
+			> (INT_MAX - HEADER_INDEX_START - HEADER_NONCE_BITS)
+						/ HEADER_ENTRY_BITS) {
+	    fprintf (stderr, "Error: too many chunks for the index.\n");
+	    return (FALSE);
+	}
+
+	if (cipher_mode_used (ctx) == CIPHER_CTR && !nonce_make (ctx))
+	    return (FALSE);
+
+	if (ctx->ice_key == NULL) {
+	    ok = encode_dense_indexed (ctx, ctx->encrypt_hold,
+					ctx->encrypt_hold_bits, inf, outf);
+	    tail_add_buffer (ctx, ctx->encrypt_hold, ctx->encrypt_hold_bits);
+	    return (ok);
+	}
+
+	ctx->index_ctr = ctx->encrypt_nonce;
+
+	if ((job.ptext = (unsigned char *) calloc (nbytes + 1, 1)) == NULL) {
+	    fprintf (stderr, "Error: out of memory\n");
+	    return (FALSE);
+	}
+
+	job.ik = ctx->ice_key;
+	job.ctext = ctx->encrypt_hold;
+	job.nbits = ctx->encrypt_hold_bits;
+	job.iv = ctx->index_ctr;
+	job.mode = CIPHER_CTR;
+	job.nthreads = decrypt_threads ((ctx->threads > 0) ? ctx->threads
+						: parallel_threads (), nbytes);
+
+	parallel_run (job.nthreads, decrypt_range, &job);
+
+	ok = encode_dense_indexed (ctx, job.ptext, job.nbits, inf, outf);
+	tail_add_buffer (ctx, job.ptext, job.nbits);
+	free (job.ptext);
+
+	return (ok);
+}
+
+
+/*
+ * Close a message with a length header with a header marking its end,
+ * on the line after the data, so no stale segment behind it is read.
+ */
+
+static BOOL
+encrypt_end (
+	SNOW_CTX	*ctx,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf
+) {
+	if (!encode_segment_end (ctx, inf, outf))
+	    return (FALSE);
+
+	ctx->encrypt_iv = ctx->encrypt_tail;
+	ctx->encrypt_mode = CIPHER_CFB;
+
+	return (encrypt_data (ctx, ((uint64_t) HEADER_MAGIC << 16)
+		| (HEADER_VERSION << 8) | HEADER_END, HEADER_BITS, inf, outf));
+}
+
+
+/*
+ * Flush the contents of the encryption routines.
+ */
+
+BOOL
+encrypt_flush (
+	SNOW_CTX	*ctx,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf
+) {
+	unsigned long	i;
+
+	if (ctx->chunk_size == 0 && ctx->encrypt_header_pending
+				&& !encrypt_header (ctx, inf, outf))
+	    return (FALSE);
+
+	if (ctx->chunk_size > 0) {
+	    if (!encrypt_hold_indexed (ctx, inf, outf))
+		return (FALSE);
+	} else if (ctx->encode_dense && ctx->threads > 1) {
+	    if (!encrypt_hold_parallel (ctx, inf, outf))
+		return (FALSE);
+	} else {
+	    for (i = 0; i < ctx->encrypt_hold_bits; i += 64) {
+		int	n = (ctx->encrypt_hold_bits - i < 64)
+					? ctx->encrypt_hold_bits - i : 64;
+
+		if (!encrypt_data (ctx, bitbuf_get (ctx->encrypt_hold, i, n),
+							n, inf, outf))
+		    return (FALSE);
+	    }
+	}
+
+	if (header_has_length (ctx) && !encrypt_end (ctx, inf, outf))
+	    return (FALSE);
+
+	free (ctx->encrypt_hold);
+	ctx->encrypt_hold = NULL;
+	ctx->encrypt_hold_size = 0;
+	ctx->encrypt_hold_bits = 0;
+
+	return (encode_flush (ctx, inf, outf));
+}
+
+
+/*
+ * Get ready to read the header of a segment starting with the given IV.
+ * Any ciphertext still collected is cleared, since bits are added to
+ * the buffer on the assumption that it is zeroed beyond those used.
+ */
+
+static void
+decrypt_start (
+	SNOW_CTX	*ctx,
+	uint64_t	iv
+) {
+	ctx->encrypt_iv = iv;
+	ctx->decrypt_iv = iv;
+	ctx->decrypt_tail = iv;
+	ctx->encrypt_mode = CIPHER_CFB;
+	ctx->decrypt_header_reading = TRUE;
+	ctx->decrypt_header_raw = 0;
+	ctx->decrypt_header_value = 0;
+	ctx->decrypt_header_bits = 0;
+	ctx->decrypt_header_size = HEADER_BITS;
+	ctx->decrypt_header_fixed = HEADER_BITS;
+	ctx->decrypt_header_nonce = 0;
+	ctx->decrypt_length_known = FALSE;
+	ctx->decrypt_done = FALSE;
+	if (ctx->decrypt_buf != NULL)
+	    memset (ctx->decrypt_buf, 0, (ctx->decrypt_buf_bits + 7) / 8);
+	ctx->decrypt_buf_bits = 0;
+	ctx->decode_dense = FALSE;
+	ctx->decode_carriers = CARRIER_WS;
+	ctx->index_count = 0;
+	ctx->index_chunk = 0;
+	ctx->index_line = 0;
+
+	uncompress_init (ctx);
+}
+
+
+/*
+ * Initialize the decryption routines.
+ */
+
+void
+decrypt_init (
+	SNOW_CTX	*ctx
+) {
+	ctx->decrypt_last = FALSE;
+	ctx->decrypt_segments = 0;
+
+	decrypt_start (ctx, ctx->encrypt_iv_start);
+}
+
+
+/*
+ * Pass decrypted data on, or store it if it is encrypted.
+ */
+
+static BOOL
+decrypt_data (
+	SNOW_CTX	*ctx,
+	uint64_t	bits,
+	int		nbits,
+	SNOW_WRITER	*outf
+) {
+	if (ctx->ice_key == NULL)
+	    return (uncompress_bits (ctx, bits, nbits, outf));
+
+	if (!bitbuf_append (&ctx->decrypt_buf, &ctx->decrypt_buf_size,
+				&ctx->decrypt_buf_bits, bits, nbits)) {
+	    fprintf (stderr, "Error: out of memory\n");
+	    return (FALSE);
+	}
+
+	return (TRUE);
+}
+
+
+/*
+ * Stop looking for the header of a further segment, which isn't there.
+ */
+
+void
+decrypt_stop (
+	SNOW_CTX	*ctx
+) {
+	ctx->decrypt_header_reading = FALSE;
+	ctx->encrypt_iv = ctx->decrypt_iv;
+	ctx->decrypt_done = TRUE;
+	ctx->decrypt_last = TRUE;
+}
+
+
+/*
+ * Give up on reading a header, and treat the bits read so far as
+ * data in 1-bit CFB mode. Past 64 bits the magic number matched, so
+ * the text ended part way through a header and there is no data.
+ * After a segment there is no more data either.
+ */
+
+static BOOL
+decrypt_header_abandon (
+	SNOW_CTX	*ctx,
+	SNOW_WRITER	*outf
+) {
+	if (ctx->decrypt_segments > 0) {
+	    decrypt_stop (ctx);
+	    return (TRUE);
+	}
+
+	ctx->decrypt_header_reading = FALSE;
+	ctx->encrypt_iv = ctx->decrypt_iv;
+
+	if (ctx->decrypt_header_bits > 64)
+	    return (TRUE);
+
+	return (decrypt_data (ctx, ctx->decrypt_header_raw,
+					ctx->decrypt_header_bits, outf));
+}
+
+
+/*
+ * Read header bits, one at a time, in 1-bit CFB mode.
+ * Returns the number of bits used.
+ */
+
+static int
+decrypt_header (
+	SNOW_CTX	*ctx,
+	uint64_t	bits,
+	int		nbits,
+	SNOW_WRITER	*outf
+) {
+	int		n = 0;
+
+	while (n < nbits && ctx->decrypt_header_reading) {
+	    int		bit = (bits >> (nbits - ++n)) & 1;
+	    int		pbit = bit;
+
+	    if (ctx->ice_key != NULL) {
+		pbit ^= keystream_bit (ctx);
+		ctx->encrypt_iv = (ctx->encrypt_iv << 1) | bit;
+	    }
+
+	    ctx->decrypt_tail = (ctx->decrypt_tail << 1) | bit;
+	    ctx->decrypt_header_raw = (ctx->decrypt_header_raw << 1) | bit;
+	    ctx->decrypt_header_value = (ctx->decrypt_header_value << 1) | pbit;
+	    ctx->decrypt_header_bits++;
+
+	    if (ctx->decrypt_header_bits == 32
+				&& ctx->decrypt_header_value != HEADER_MAGIC) {
+		if (!decrypt_header_abandon (ctx, outf))
+		    return (-1);
+	    } else if (ctx->decrypt_header_bits == HEADER_BITS) {
+		int	version = (ctx->decrypt_header_value >> 8) & 0xff;
+
+		ctx->decrypt_header_flags = ctx->decrypt_header_value & 0xff;
+
+		if ((ctx->decrypt_header_flags & HEADER_CTR) != 0) {
+		    if (version <= HEADER_VERSION_NONCE) {
+			fprintf (stderr,
+			    "Counter mode header version %d has no nonce\n",
+								version);
+			return (-1);
+		    }
+		    version -= HEADER_VERSION_NONCE;
+		    ctx->decrypt_header_nonce = HEADER_NONCE_BITS;
+		}
+
+		if (version == HEADER_VERSION_LEN
+					|| version == HEADER_VERSION_DENSE
+					|| version == HEADER_VERSION_INDEX) {
+		    ctx->decrypt_header_size += HEADER_LEN_BITS;
+		    ctx->uncompress_flag = (ctx->decrypt_header_flags
+						& HEADER_COMPRESS) != 0;
+		}
+
+		if (version == HEADER_VERSION_INDEX
+				&& ctx->decrypt_header_nonce == 0) {
+		    fprintf (stderr, "Chunk index in header has no nonce\n");
+		    return (-1);
+		} else if (version == HEADER_VERSION_INDEX) {
+		    ctx->decrypt_header_size += HEADER_LINE_BITS
+				+ HEADER_CHUNK_BITS + HEADER_START_BITS;
+		} else if (version == HEADER_VERSION_DENSE) {
+		    ctx->decrypt_header_size += HEADER_LINE_BITS;
+		} else if (version != HEADER_VERSION
+					&& version != HEADER_VERSION_LEN) {
+		    fprintf (stderr, "Unsupported header version %d\n",
+								version);
+		    return (-1);
+		}
+
+		ctx->decrypt_header_fixed = ctx->decrypt_header_size;
+		ctx->decrypt_header_size += ctx->decrypt_header_nonce;
+	    } else if (ctx->decrypt_header_bits > ctx->decrypt_header_fixed
+					+ ctx->decrypt_header_nonce) {
+		int	k = (ctx->decrypt_header_bits - ctx->decrypt_header_fixed
+			- ctx->decrypt_header_nonce) % HEADER_ENTRY_BITS;
+
+		if (k == HEADER_LEN_BITS && !index_append (ctx,
+				ctx->decrypt_header_value
+				& (((uint64_t) 1 << HEADER_LEN_BITS) - 1), 0))
+		    return (-1);
+		else if (k == 0)
+		    ctx->index[ctx->index_count - 1].bits
+					= ctx->decrypt_header_value
+				& (((uint64_t) 1 << HEADER_LINE_BITS) - 1);
+	    } else if (ctx->decrypt_header_bits > ctx->decrypt_header_fixed) {
+		if (ctx->decrypt_header_bits == ctx->decrypt_header_fixed
+						+ ctx->decrypt_header_nonce) {
+		    ctx->encrypt_nonce = ctx->decrypt_header_value;
+		    ctx->index_ctr = ctx->encrypt_nonce;
+		}
+	    } else if (ctx->decrypt_header_bits == HEADER_LEN_END) {
+		ctx->decrypt_length = ctx->decrypt_header_value
+				& (((uint64_t) 1 << HEADER_LEN_BITS) - 1);
+	    } else if (ctx->decrypt_header_bits == HEADER_LINE_END) {
+		int	len = ctx->decrypt_header_value
+				& (((uint64_t) 1 << HEADER_LINE_BITS) - 1);
+
+		if (len < 8) {
+		    fprintf (stderr, "Illegal line length %d in header\n",
+									len);
+		    return (-1);
+		}
+
+		if (!dense_init (ctx, len))
+		    return (-1);
+	    } else if (ctx->decrypt_header_bits == HEADER_CHUNK_END) {
+		ctx->index_chunk = ctx->decrypt_header_value & 0xffffffffUL;
+
+		if (ctx->index_chunk == 0 || ctx->index_chunk % 8 != 0) {
+		    fprintf (stderr, "Illegal chunk size %lu in header\n",
+							ctx->index_chunk);
+		    return (-1);
+		}
+	    } else if (ctx->decrypt_header_bits == HEADER_INDEX_START) {
+		uint64_t	entries = index_entries (ctx->index_chunk,
+							ctx->decrypt_length);
+
+		ctx->index_line = ctx->decrypt_header_value
+				& (((uint64_t) 1 << HEADER_START_BITS) - 1);
+
+		if (entries > (uint64_t) (INT_MAX - ctx->decrypt_header_size)
+						/ HEADER_ENTRY_BITS) {
+		    fprintf (stderr, "Chunk index in header is too large\n");
+		    return (-1);
+		}
+		ctx->decrypt_header_size += entries * HEADER_ENTRY_BITS;
+	    }
+
+	    if (ctx->decrypt_header_reading
+		    && ctx->decrypt_header_bits == ctx->decrypt_header_size) {
+		if (ctx->decrypt_header_fixed > HEADER_BITS) {
+		    ctx->decrypt_length_known = TRUE;
+		    ctx->decrypt_done = (ctx->decrypt_length == 0);
+		}
+
+		if (ctx->decrypt_header_fixed > HEADER_LEN_END) {
+		    ctx->decode_dense = TRUE;
+		    ctx->decode_carriers = 0;
+		    if ((ctx->decrypt_header_flags & HEADER_NO_WS) == 0)
+			ctx->decode_carriers |= CARRIER_WS;
+		    if ((ctx->decrypt_header_flags & HEADER_ZW) != 0)
+			ctx->decode_carriers |= CARRIER_ZW;
+		    if ((ctx->decrypt_header_flags & HEADER_EOL) != 0)
+			ctx->decode_carriers |= CARRIER_EOL;
+		}
+
+		if ((ctx->decrypt_header_flags & HEADER_END) != 0) {
+		    if (ctx->decrypt_segments == 0) {
+			fprintf (stderr, "Header ends a message it doesn't follow\n");
+			return (-1);
+		    }
+		    decrypt_stop (ctx);
+		    break;
+		}
+
+		if (ctx->decrypt_header_nonce > 0)
+		    ctx->encrypt_iv = ctx->encrypt_nonce;
+
+		ctx->decrypt_header_reading = FALSE;
+		cipher_mode_start (ctx, (ctx->decrypt_header_flags
+				& HEADER_CTR) != 0 ? CIPHER_CTR : CIPHER_CFB);
+	    }
+	}
+
+	return (n);
+}
+
+
+/*
+ * Decrypt a number of bits.
+ * When encrypted, the bits are stored until decrypt_flush() is called.
+ * Bits beyond the data length given in the header are ignored.
+ */
+
+BOOL
+decrypt_bits (
+	SNOW_CTX	*ctx,
+	uint64_t	bits,
+	int		nbits,
+	SNOW_WRITER	*outf
+) {
+	if (ctx->decrypt_header_reading) {
+	    int		n = decrypt_header (ctx, bits, nbits, outf);
+
+	    if (n < 0)
+		return (FALSE);
+	    nbits -= n;
+	}
+
+	if (ctx->decrypt_done)
+	    return (TRUE);
+
+	if (ctx->decrypt_length_known) {
+	    if ((uint64_t) nbits >= ctx->decrypt_length) {
+		bits >>= nbits - ctx->decrypt_length;
+		nbits = ctx->decrypt_length;
+		ctx->decrypt_done = TRUE;
+	    }
+	    ctx->decrypt_length -= nbits;
+	}
+
+	if (nbits == 0)
+	    return (TRUE);
+
+	bits &= ((uint64_t) 2 << (nbits - 1)) - 1;
+	ctx->decrypt_tail = (nbits < 64) ? (ctx->decrypt_tail << nbits) | bits
+								: bits;
+
+	return (decrypt_data (ctx, bits, nbits, outf));
+}
+
+
+/*
+ * Decrypt a single bit.
+ * Retained for compatibility - use decrypt_bits() instead.
+ */
+
+BOOL
+decrypt_bit (
+	SNOW_CTX	*ctx,
+	int		bit,
+	SNOW_WRITER	*outf
+) {
+	return (decrypt_bits (ctx, bit, 1, outf));
+}
+
+
+/*
+ * Flush the contents of the decryption routines.
+ */
+
+BOOL
+decrypt_flush (
+	SNOW_CTX	*ctx,
+	SNOW_WRITER	*outf
+) {
+	DECRYPT_JOB	job;
+	unsigned long	i, nbytes;
+	BOOL		ok = TRUE;
+
+	if (ctx->decrypt_header_reading && !decrypt_header_abandon (ctx, outf))
+	    return (FALSE);
+
+	if (ctx->ice_key == NULL)
+	    return (uncompress_flush (ctx));
+
+	nbytes = (ctx->decrypt_buf_bits + 7) / 8;
+	if ((job.ptext = (unsigned char *) malloc (nbytes + 1)) == NULL) {
+	    fprintf (stderr, "Error: out of memory\n");
+	    return (FALSE);
+	}
+
+	job.ik = ctx->ice_key;
+	job.ctext = ctx->decrypt_buf;
+	job.nbits = ctx->decrypt_buf_bits;
+	job.iv = ctx->encrypt_iv;
+	job.mode = ctx->encrypt_mode;
+	job.nthreads = decrypt_threads ((ctx->threads > 0) ? ctx->threads
+						: parallel_threads (), nbytes);
+
+	parallel_run (job.nthreads, decrypt_range, &job);
+
+	for (i = 0; i < ctx->decrypt_buf_bits && ok; i += 64) {
+	    int		n = (ctx->decrypt_buf_bits - i < 64)
+						? ctx->decrypt_buf_bits - i : 64;
+
+	    ok = uncompress_bits (ctx, bitbuf_get (job.ptext, i, n), n, outf);
+	}
+
+	free (job.ptext);
+	free (ctx->decrypt_buf);
+	ctx->decrypt_buf = NULL;
+	ctx->decrypt_buf_size = 0;
+	ctx->decrypt_buf_bits = 0;
+
+	if (!ok)
+	    return (FALSE);
+
+	return (uncompress_flush (ctx));
+}
+
+
+/*
+ * Flush the data of a segment that has all been read, then start
+ * looking for the header of another segment appended after it.
+ */
+
+BOOL
+decrypt_next (
+	SNOW_CTX	*ctx,
+	SNOW_WRITER	*outf
+) {
+	if (!decrypt_flush (ctx, outf))
+	    return (FALSE);
+
+	ctx->decrypt_segments++;
+	decrypt_start (ctx, ctx->decrypt_tail);
+
+	return (TRUE);
+}
+
+
+/*
+ * Decrypt, in place, nbits of an indexed message starting at the given
+ * chunk. Its counter is found from the chunk's position.
+ */
+
+void
+decrypt_chunks (
+	SNOW_CTX	*ctx,
+	unsigned char	*buf,
+	unsigned long	nbits,
+	unsigned long	chunk
+) {
+	unsigned long	nbytes = (nbits + 7) / 8;
+	DECRYPT_JOB	job;
+
+	if (ctx->ice_key == NULL)
+	    return;
+
+	job.ik = ctx->ice_key;
+	job.ctext = buf;
+	job.ptext = buf;
+	job.nbits = nbits;
+	job.iv = ctx->index_ctr + (uint64_t) chunk * (ctx->index_chunk / 8);
+	job.mode = CIPHER_CTR;
+	job.nthreads = decrypt_threads ((ctx->threads > 0) ? ctx->threads
+						: parallel_threads (), nbytes);
+
+	parallel_run (job.nthreads, decrypt_range, &job);
+}
+
+
+/*
+ * Free the key and any buffers held by the encryption routines.
+ */
+
+void
+encrypt_destroy (
+	SNOW_CTX	*ctx
+) {
+	if (ctx->ice_key != NULL) {
+	    ice_key_destroy (ctx->ice_key);
+	    ctx->ice_key = NULL;
+	}
+
+	free (ctx->decrypt_buf);
+	ctx->decrypt_buf = NULL;
+	ctx->decrypt_buf_size = 0;
+	ctx->decrypt_buf_bits = 0;
+
+	free (ctx->encrypt_hold);
+	ctx->encrypt_hold = NULL;
+	ctx->encrypt_hold_size = 0;
+	ctx->encrypt_hold_bits = 0;
 
-	return (uncompress_flush (outf));
+	free (ctx->index);
+	ctx->index = NULL;
+	ctx->index_size = 0;
+	ctx->index_count = 0;
 }
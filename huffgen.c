@@ -0,0 +1,155 @@
+/*
+ * Generates the binary Huffman code and decoding tables for the SNOW
+ * steganography program from the code strings in huffcode.h.
+ *
+ * Usage: huffgen [-d]
+ *
+ *	-d : Write the decoding tables rather than the codes
+ *
+ * Copyright (C) 1999 Matthew Kwan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ *
+ * For license text, see https://spdx.org/licenses/Apache-2.0>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+
+/*
+ * The Huffman codes.
+ */
+
+static const char	*huffcodes[256] = {
+#include "huffcode.h"
+};
+
+
+/*
+ * The Huffman decoding tables.
+ * Codes are decoded 8 bits at a time. An entry with a non-zero length
+ * decodes a byte using that many bits of the index. Otherwise the value
+ * is the number of the table which decodes the following 8 bits, with
+ * zero (the root table) marking an invalid code.
+ */
+
+#define HUFF_TABLES_MAX	64
+
+static struct {
+	int		len;
+	int		val;
+} huff_table[HUFF_TABLES_MAX][256];
+static int		huff_tables_used = 1;
+
+
+/*
+ * Build the decoding tables, and write them to stdout.
+ */
+
+static int
+huff_table_write (void)
+{
+	int		i, t;
+
+	for (i=0; i<256; i++) {
+	    const char	*s = huffcodes[i];
+	    int		len = strlen (s);
+	    int		j, idx;
+
+	    t = 0;
+	    while (len > 8) {
+		for (idx = 0, j = 0; j < 8; j++)
+		    idx = (idx << 1) | (s[j] == '1');
+
+		if (huff_table[t][idx].val == 0) {
+		    if (huff_tables_used == HUFF_TABLES_MAX) {
+			fprintf (stderr, "Huffman table overflow\n");
+			return 1;
+		    }
+		    huff_table[t][idx].val = huff_tables_used++;
+		}
+
+		t = huff_table[t][idx].val;
+		s += 8;
+		len -= 8;
+	    }
+
+	    for (idx = 0, j = 0; j < len; j++)
+		idx = (idx << 1) | (s[j] == '1');
+
+			/* Fill every entry that starts with the code */
+	    for (j = idx << (8 - len); j < (idx + 1) << (8 - len); j++) {
+		huff_table[t][j].len = len;
+		huff_table[t][j].val = i;
+	    }
+	}
+
+	printf ("/*\n * Generated by huffgen -d from huffcode.h - do not edit.\n");
+	printf (" * %d decoding tables of (length, value) entries.\n */\n\n",
+							huff_tables_used);
+
+	for (t=0; t<huff_tables_used; t++) {
+	    printf ("{\t/* Table %d */\n", t);
+
+	    for (i=0; i<256; i++)
+		printf ("%s{%d, %d},%s", (i & 7) == 0 ? "\t" : " ",
+				huff_table[t][i].len, huff_table[t][i].val,
+				(i & 7) == 7 ? "\n" : "");
+
+	    printf ("},\n");
+	}
+
+	return 0;
+}
+
+
+/*
+ * Write the table of packed codes and their lengths to stdout,
+ * or the decoding tables if -d is given.
+ */
+
+int
+main (
+	int		argc,
+	char		*argv[]
+) {
+	int		i;
+
+	if (argc > 1 && strcmp (argv[1], "-d") == 0)
+	    return (huff_table_write ());
+
+	printf ("/*\n * Generated by huffgen from huffcode.h - do not edit.\n");
+	printf (" * Each entry is the code, packed into an integer, and its length in bits.\n */\n\n");
+
+	for (i=0; i<256; i++) {
+	    const char		*s;
+	    unsigned long	code = 0;
+	    int			len = 0;
+
+	    for (s = huffcodes[i]; *s != '\0'; s++, len++) {
+		if (*s != '0' && *s != '1') {
+		    fprintf (stderr, "Illegal Huffman character '%c'\n", *s);
+		    return 1;
+		}
+
+		code = (code << 1) | (*s == '1');
+	    }
+
+	    if (len == 0 || len > 32) {
+		fprintf (stderr, "Illegal Huffman code length %d\n", len);
+		return 1;
+	    }
+
+	    printf ("{0x%08lx, %2d},\t/* %d */\n", code, len, i);
+	}
+
+	return 0;
+}
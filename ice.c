@@ -18,10 +18,17 @@
 #include "ice.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__)) \
+						&& !defined (ICE_NO_SIMD)
+#define ICE_AVX2
+#include <immintrin.h>
+#endif
 
 
 	/* Structure of a single round subkey */
-typedef unsigned long	ICE_SUBKEY[3];
+typedef uint32_t	ICE_SUBKEY[3];
 
 
 	/* Internal structure of the ICE_KEY structure */
@@ -31,35 +38,10 @@ struct ice_key_struct {
 	ICE_SUBKEY	*ik_keysched;
 };
 
-	/* The S-boxes */
-static unsigned long	ice_sbox[4][1024];
-static int		ice_sboxes_initialised = 0;
-
-
-	/* Modulo values for the S-boxes */
-static const int	ice_smod[4][4] = {
-				{333, 313, 505, 369},
-				{379, 375, 319, 391},
-				{361, 445, 451, 397},
-				{397, 425, 395, 505}};
-
-	/* XOR values for the S-boxes */
-static const int	ice_sxor[4][4] = {
-				{0x83, 0x85, 0x9b, 0xcd},
-				{0xcc, 0xa7, 0xad, 0x41},
-				{0x4b, 0x2e, 0xd4, 0x33},
-				{0xea, 0xcb, 0x2e, 0x04}};
-
-	/* Expanded permutation values for the P-box */
-static const unsigned long	ice_pbox[32] = {
-		0x00000001, 0x00000080, 0x00000400, 0x00002000,
-		0x00080000, 0x00200000, 0x01000000, 0x40000000,
-		0x00000008, 0x00000020, 0x00000100, 0x00004000,
-		0x00010000, 0x00800000, 0x04000000, 0x20000000,
-		0x00000004, 0x00000010, 0x00000200, 0x00008000,
-		0x00020000, 0x00400000, 0x08000000, 0x10000000,
-		0x00000002, 0x00000040, 0x00000800, 0x00001000,
-		0x00040000, 0x00100000, 0x02000000, 0x80000000};
+	/* The S-boxes, 16 KB in total, generated by icegen at build time */
+static const uint32_t	ice_sbox[4][1024] = {
+#include "icesbox.h"
+};
 
 	/* The key rotation schedule */
 static const int	ice_keyrot[16] = {
@@ -67,109 +49,6 @@ static const int	ice_keyrot[16] = {
 				1, 3, 2, 0, 3, 1, 0, 2};
 
 
-/*
- * Galois Field multiplication of a by b, modulo m.
- * Just like arithmetic multiplication, except that additions and
- * subtractions are replaced by XOR.
- */
-
-static unsigned int
-gf_mult (
-	register unsigned int	a,
-	register unsigned int	b,
-	register unsigned int	m
-) {
-	register unsigned int	res = 0;
-
-	while (b) {
-	    if (b & 1)
-		res ^= a;
-
-	    a <<= 1;
-	    b >>= 1;
-
-	    if (a >= 256)
-		a ^= m;
-	}
-
-	return (res);
-}
-
-
-/*
- * Galois Field exponentiation.
- * Raise the base to the power of 7, modulo m.
- */
-
-static unsigned long
-gf_exp7 (
-	register unsigned int	b,
-	unsigned int		m
-) {
-	register unsigned int	x;
-
-	if (b == 0)
-	    return (0);
-
-	x = gf_mult (b, b, m);
-	x = gf_mult (b, x, m);
-	x = gf_mult (x, x, m);
-	return (gf_mult (b, x, m));
-}
-
-
-/*
- * Carry out the ICE 32-bit P-box permutation.
- */
-
-static unsigned long
-ice_perm32 (
-	register unsigned long	x
-) {
-	register unsigned long		res = 0;
-	register const unsigned long	*pbox = ice_pbox;
-
-	while (x) {
-	    if (x & 1)
-		res |= *pbox;
-	    pbox++;
-	    x >>= 1;
-	}
-
-	return (res);
-}
-
-
-/*
- * Initialise the ICE S-boxes.
- * This only has to be done once.
- */
-
-static void
-ice_sboxes_init (void)
-{
-	register int	i;
-
-	for (i=0; i<1024; i++) {
-	    int			col = (i >> 1) & 0xff;
-	    int			row = (i & 0x1) | ((i & 0x200) >> 8);
-	    unsigned long	x;
-
-	    x = gf_exp7 (col ^ ice_sxor[0][row], ice_smod[0][row]) << 24;
-	    ice_sbox[0][i] = ice_perm32 (x);
-
-	    x = gf_exp7 (col ^ ice_sxor[1][row], ice_smod[1][row]) << 16;
-	    ice_sbox[1][i] = ice_perm32 (x);
-
-	    x = gf_exp7 (col ^ ice_sxor[2][row], ice_smod[2][row]) << 8;
-	    ice_sbox[2][i] = ice_perm32 (x);
-
-	    x = gf_exp7 (col ^ ice_sxor[3][row], ice_smod[3][row]);
-	    ice_sbox[3][i] = ice_perm32 (x);
-	}
-}
-
-
 /*
  * Create a new ICE key.
  */
@@ -180,11 +59,6 @@ ice_key_create (
 ) {
 	ICE_KEY		*ik;
 
-	if (!ice_sboxes_initialised) {
-	    ice_sboxes_init ();
-	    ice_sboxes_initialised = 1;
-	}
-
 	if ((ik = (ICE_KEY *) malloc (sizeof (ICE_KEY))) == NULL)
 	    return (NULL);
 
@@ -237,13 +111,13 @@ ice_key_destroy (
  * The single round ICE f function.
  */
 
-static unsigned long
+static uint32_t
 ice_f (
-	register unsigned long	p,
+	register uint32_t	p,
 	const ICE_SUBKEY	sk
 ) {
-	unsigned long	tl, tr;		/* Expanded 40-bit values */
-	unsigned long	al, ar;		/* Salted expanded 40-bit values */
+	uint32_t	tl, tr;		/* Expanded 40-bit values */
+	uint32_t	al, ar;		/* Salted expanded 40-bit values */
 
 					/* Left half expansion */
 	tl = ((p >> 16) & 0x3ff) | (((p >> 14) | (p << 18)) & 0xffc00);
@@ -267,8 +141,20 @@ ice_f (
 }
 
 
+/*
+ * Carry out two rounds of ICE, in the forward or reverse direction.
+ */
+
+#define ICE_ROUNDS_FWD(i)	l ^= ice_f (r, ks[i]); \
+				r ^= ice_f (l, ks[(i) + 1])
+
+#define ICE_ROUNDS_REV(i)	l ^= ice_f (r, ks[i]); \
+				r ^= ice_f (l, ks[(i) - 1])
+
+
 /*
  * Encrypt a block of 8 bytes of data with the given ICE key.
+ * Thin-ICE and standard ICE have fully unrolled round loops.
  */
 
 void
@@ -278,18 +164,38 @@ ice_key_encrypt (
 	unsigned char		*ctext
 ) {
 	register int		i;
-	register unsigned long	l, r;
-
-	l = (((unsigned long) ptext[0]) << 24)
-				| (((unsigned long) ptext[1]) << 16)
-				| (((unsigned long) ptext[2]) << 8) | ptext[3];
-	r = (((unsigned long) ptext[4]) << 24)
-				| (((unsigned long) ptext[5]) << 16)
-				| (((unsigned long) ptext[6]) << 8) | ptext[7];
-
-	for (i = 0; i < ik->ik_rounds; i += 2) {
-	    l ^= ice_f (r, ik->ik_keysched[i]);
-	    r ^= ice_f (l, ik->ik_keysched[i + 1]);
+	register uint32_t	l, r;
+	const ICE_SUBKEY	*ks = ik->ik_keysched;
+
+	l = (((uint32_t) ptext[0]) << 24)
+				| (((uint32_t) ptext[1]) << 16)
+				| (((uint32_t) ptext[2]) << 8) | ptext[3];
+	r = (((uint32_t) ptext[4]) << 24)
+				| (((uint32_t) ptext[5]) << 16)
+				| (((uint32_t) ptext[6]) << 8) | ptext[7];
+
+	switch (ik->ik_rounds) {
+	    case 16:
+		ICE_ROUNDS_FWD (0);
+		ICE_ROUNDS_FWD (2);
+		ICE_ROUNDS_FWD (4);
+		ICE_ROUNDS_FWD (6);
+		ICE_ROUNDS_FWD (8);
+		ICE_ROUNDS_FWD (10);
+		ICE_ROUNDS_FWD (12);
+		ICE_ROUNDS_FWD (14);
+		break;
+	    case 8:
+		ICE_ROUNDS_FWD (0);
+		ICE_ROUNDS_FWD (2);
+		ICE_ROUNDS_FWD (4);
+		ICE_ROUNDS_FWD (6);
+		break;
+	    default:
+		for (i = 0; i < ik->ik_rounds; i += 2) {
+		    ICE_ROUNDS_FWD (i);
+		}
+		break;
 	}
 
 	for (i = 0; i < 4; i++) {
@@ -302,6 +208,135 @@ ice_key_encrypt (
 }
 
 
+#ifdef ICE_AVX2
+
+/*
+ * The ICE f function applied to 8 blocks at once, using AVX2 gathers
+ * for the S-box lookups.
+ */
+
+__attribute__ ((target ("avx2")))
+static __m256i
+ice_f_avx2 (
+	__m256i			p,
+	const ICE_SUBKEY	sk
+) {
+	const __m256i	m10 = _mm256_set1_epi32 (0x3ff);
+	const __m256i	m20 = _mm256_set1_epi32 (0xffc00);
+	__m256i		tl, tr, al, ar, x;
+
+					/* Left half expansion */
+	tl = _mm256_or_si256 (_mm256_and_si256 (_mm256_srli_epi32 (p, 16), m10),
+		_mm256_and_si256 (_mm256_or_si256 (_mm256_srli_epi32 (p, 14),
+					_mm256_slli_epi32 (p, 18)), m20));
+
+					/* Right half expansion */
+	tr = _mm256_or_si256 (_mm256_and_si256 (p, m10),
+			_mm256_and_si256 (_mm256_slli_epi32 (p, 2), m20));
+
+					/* Perform the salt permutation */
+	al = _mm256_and_si256 (_mm256_set1_epi32 ((int) sk[2]),
+						_mm256_xor_si256 (tl, tr));
+	ar = _mm256_xor_si256 (al, tr);
+	al = _mm256_xor_si256 (al, tl);
+
+					/* XOR with the subkey */
+	al = _mm256_xor_si256 (al, _mm256_set1_epi32 ((int) sk[0]));
+	ar = _mm256_xor_si256 (ar, _mm256_set1_epi32 ((int) sk[1]));
+
+					/* S-box lookup and permutation */
+	x = _mm256_i32gather_epi32 ((const int *) ice_sbox[0],
+				_mm256_srli_epi32 (al, 10), sizeof (ice_sbox[0][0]));
+	x = _mm256_or_si256 (x, _mm256_i32gather_epi32 ((const int *) ice_sbox[1],
+				_mm256_and_si256 (al, m10), sizeof (ice_sbox[0][0])));
+	x = _mm256_or_si256 (x, _mm256_i32gather_epi32 ((const int *) ice_sbox[2],
+				_mm256_srli_epi32 (ar, 10), sizeof (ice_sbox[0][0])));
+	x = _mm256_or_si256 (x, _mm256_i32gather_epi32 ((const int *) ice_sbox[3],
+				_mm256_and_si256 (ar, m10), sizeof (ice_sbox[0][0])));
+
+	return (x);
+}
+
+
+/*
+ * Encrypt 8 blocks of 8 bytes with AVX2 instructions.
+ */
+
+__attribute__ ((target ("avx2")))
+static void
+ice_key_encrypt8_avx2 (
+	const ICE_KEY		*ik,
+	const unsigned char	*ptext,
+	unsigned char		*ctext
+) {
+	int		i;
+	uint32_t	lw[8], rw[8];
+	__m256i		l, r;
+
+	for (i=0; i<8; i++) {
+	    const unsigned char	*pt = &ptext[i * 8];
+
+	    lw[i] = ((uint32_t) pt[0] << 24) | ((uint32_t) pt[1] << 16)
+				| ((uint32_t) pt[2] << 8) | pt[3];
+	    rw[i] = ((uint32_t) pt[4] << 24) | ((uint32_t) pt[5] << 16)
+				| ((uint32_t) pt[6] << 8) | pt[7];
+	}
+
+	l = _mm256_loadu_si256 ((const __m256i *) lw);
+	r = _mm256_loadu_si256 ((const __m256i *) rw);
+
+	for (i = 0; i < ik->ik_rounds; i += 2) {
+	    l = _mm256_xor_si256 (l, ice_f_avx2 (r, ik->ik_keysched[i]));
+	    r = _mm256_xor_si256 (r, ice_f_avx2 (l, ik->ik_keysched[i + 1]));
+	}
+
+	_mm256_storeu_si256 ((__m256i *) lw, l);
+	_mm256_storeu_si256 ((__m256i *) rw, r);
+
+	for (i=0; i<8; i++) {
+	    unsigned char	*ct = &ctext[i * 8];
+	    int			j;
+
+	    for (j=0; j<4; j++) {
+		ct[3 - j] = (rw[i] >> (j * 8)) & 0xff;
+		ct[7 - j] = (lw[i] >> (j * 8)) & 0xff;
+	    }
+	}
+}
+
+#endif
+
+
+/*
+ * Encrypt a number of consecutive 8-byte blocks with the given ICE key.
+ * Uses SIMD instructions when the CPU supports them.
+ */
+
+void
+ice_key_encrypt_blocks (
+	const ICE_KEY		*ik,
+	const unsigned char	*ptext,
+	unsigned char		*ctext,
+	int			nblocks
+) {
+#ifdef ICE_AVX2
+	if (nblocks >= 8 && __builtin_cpu_supports ("avx2")) {
+	    for (; nblocks >= 8; nblocks -= 8) {
+		ice_key_encrypt8_avx2 (ik, ptext, ctext);
+		ptext += 64;
+		ctext += 64;
+	    }
+	}
+#endif
+
+	for (; nblocks > 0; nblocks--) {
+	    ice_key_encrypt (ik, ptext, ctext);
+	    ptext += 8;
+	    ctext += 8;
+	}
+}
+
+
 /*
  * Decrypt a block of 8 bytes of data with the given ICE key.
  */
@@ -313,18 +348,38 @@ ice_key_decrypt (
 	unsigned char		*ptext
 ) {
 	register int		i;
-	register unsigned long	l, r;
-
-	l = (((unsigned long) ctext[0]) << 24)
-				| (((unsigned long) ctext[1]) << 16)
-				| (((unsigned long) ctext[2]) << 8) | ctext[3];
-	r = (((unsigned long) ctext[4]) << 24)
-				| (((unsigned long) ctext[5]) << 16)
-				| (((unsigned long) ctext[6]) << 8) | ctext[7];
-
-	for (i = ik->ik_rounds - 1; i > 0; i -= 2) {
-	    l ^= ice_f (r, ik->ik_keysched[i]);
-	    r ^= ice_f (l, ik->ik_keysched[i - 1]);
+	register uint32_t	l, r;
+	const ICE_SUBKEY	*ks = ik->ik_keysched;
+
+	l = (((uint32_t) ctext[0]) << 24)
+				| (((uint32_t) ctext[1]) << 16)
+				| (((uint32_t) ctext[2]) << 8) | ctext[3];
+	r = (((uint32_t) ctext[4]) << 24)
+				| (((uint32_t) ctext[5]) << 16)
+				| (((uint32_t) ctext[6]) << 8) | ctext[7];
+
+	switch (ik->ik_rounds) {
+	    case 16:
+		ICE_ROUNDS_REV (15);
+		ICE_ROUNDS_REV (13);
+		ICE_ROUNDS_REV (11);
+		ICE_ROUNDS_REV (9);
+		ICE_ROUNDS_REV (7);
+		ICE_ROUNDS_REV (5);
+		ICE_ROUNDS_REV (3);
+		ICE_ROUNDS_REV (1);
+		break;
+	    case 8:
+		ICE_ROUNDS_REV (7);
+		ICE_ROUNDS_REV (5);
+		ICE_ROUNDS_REV (3);
+		ICE_ROUNDS_REV (1);
+		break;
+	    default:
+		for (i = ik->ik_rounds - 1; i > 0; i -= 2) {
+		    ICE_ROUNDS_REV (i);
+		}
+		break;
 	}
 
 	for (i = 0; i < 4; i++) {
@@ -360,7 +415,7 @@ ice_key_sched_build (
 
 	    for (j=0; j<15; j++) {
 		register int	k;
-		unsigned long	*curr_sk = &(*isk)[j % 3];
+		uint32_t	*curr_sk = &(*isk)[j % 3];
 
 		for (k=0; k<4; k++) {
 		    unsigned short	*curr_kb = &kb[(kr + k) & 3];
@@ -0,0 +1,347 @@
+/*
+ * Benchmark and known-answer tests for the ICE encryption library.
+ *
+ * Copyright (C) 1999 Matthew Kwan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ *
+ * For license text, see https://spdx.org/licenses/Apache-2.0>.
+ *
+ * DESCRIPTION
+ *
+ * Checks the ICE implementation against the published test vectors,
+ * checks that the batch and single block functions agree, then reports
+ * the speed of key setup, encryption and decryption at various levels.
+ *
+ * Usage: icebench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ice.h"
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define HAVE_RDTSC
+#include <x86intrin.h>
+#endif
+
+
+/*
+ * The published ICE test vectors.
+ */
+
+static const struct {
+	int		level;
+	const char	*key;
+	const char	*ptext;
+	const char	*ctext;
+} kat_vectors[] = {
+	{0, "deadbeef01234567", "fedcba9876543210", "de240d83a00a9cc0"},
+	{1, "deadbeef01234567", "fedcba9876543210", "7d6ef1ef30d47a96"},
+	{2, "00112233445566778899aabbccddeeff",
+				"fedcba9876543210", "f94840d86972f21c"}
+};
+
+
+/*
+ * The levels to benchmark.
+ */
+
+static const int	bench_levels[] = {0, 1, 2, 4, 8, 32};
+
+#define NLEVELS		(sizeof (bench_levels) / sizeof (bench_levels[0]))
+#define NBLOCKS		4096
+
+
+/*
+ * Convert a hex string to bytes.
+ */
+
+static int
+hex_decode (
+	const char	*s,
+	unsigned char	*buf
+) {
+	int		n = 0;
+
+	for (; s[0] != '\0' && s[1] != '\0'; s += 2) {
+	    unsigned int	x;
+
+	    if (sscanf (s, "%2x", &x) != 1)
+		break;
+	    buf[n++] = x;
+	}
+
+	return (n);
+}
+
+
+/*
+ * Fill a buffer with reproducible pseudo-random bytes.
+ */
+
+static void
+fill_bytes (
+	unsigned char	*buf,
+	int		n,
+	unsigned long	seed
+) {
+	int		i;
+
+	for (i=0; i<n; i++) {
+	    seed = seed * 1103515245 + 12345;
+	    buf[i] = (seed >> 16) & 0xff;
+	}
+}
+
+
+/*
+ * Check the known-answer vectors, and that encrypting blocks in
+ * batches gives the same answer as encrypting them one at a time.
+ * Returns the number of failures.
+ */
+
+static int
+kat_check (void)
+{
+	int		i, failures = 0;
+	unsigned char	*pt, *ct1, *ct2;
+
+	for (i=0; i<(int) (sizeof (kat_vectors) / sizeof (kat_vectors[0])); i++) {
+	    ICE_KEY		*ik = ice_key_create (kat_vectors[i].level);
+	    unsigned char	key[1024], p[8], c[8], buf[8];
+
+	    hex_decode (kat_vectors[i].key, key);
+	    hex_decode (kat_vectors[i].ptext, p);
+	    hex_decode (kat_vectors[i].ctext, c);
+
+	    ice_key_set (ik, key);
+	    ice_key_encrypt (ik, p, buf);
+	    if (memcmp (buf, c, 8) != 0) {
+		printf ("FAIL: level %d known-answer encryption\n",
+						kat_vectors[i].level);
+		failures++;
+	    }
+
+	    ice_key_decrypt (ik, c, buf);
+	    if (memcmp (buf, p, 8) != 0) {
+		printf ("FAIL: level %d known-answer decryption\n",
+						kat_vectors[i].level);
+		failures++;
+	    }
+
+	    ice_key_destroy (ik);
+	}
+
+	pt = (unsigned char *) malloc (NBLOCKS * 8);
+	ct1 = (unsigned char *) malloc (NBLOCKS * 8);
+	ct2 = (unsigned char *) malloc (NBLOCKS * 8);
+	if (pt == NULL || ct1 == NULL || ct2 == NULL) {
+	    printf ("FAIL: out of memory\n");
+	    return (failures + 1);
+	}
+
+	for (i=0; i<(int) NLEVELS; i++) {
+	    int			j, level = bench_levels[i];
+	    ICE_KEY		*ik = ice_key_create (level);
+	    unsigned char	key[1024];
+
+	    fill_bytes (key, sizeof (key), level);
+	    fill_bytes (pt, NBLOCKS * 8, level + 1000);
+	    ice_key_set (ik, key);
+
+	    for (j=0; j<NBLOCKS; j++)
+		ice_key_encrypt (ik, &pt[j * 8], &ct1[j * 8]);
+
+			/* An odd count exercises the non-SIMD tail */
+	    ice_key_encrypt_blocks (ik, pt, ct2, NBLOCKS - 3);
+	    ice_key_encrypt_blocks (ik, &pt[(NBLOCKS - 3) * 8],
+					&ct2[(NBLOCKS - 3) * 8], 3);
+
+	    if (memcmp (ct1, ct2, NBLOCKS * 8) != 0) {
+		printf ("FAIL: level %d batch encryption mismatch\n", level);
+		failures++;
+	    }
+
+	    for (j=0; j<NBLOCKS; j++)
+		ice_key_decrypt (ik, &ct1[j * 8], &ct2[j * 8]);
+
+	    if (memcmp (pt, ct2, NBLOCKS * 8) != 0) {
+		printf ("FAIL: level %d decryption mismatch\n", level);
+		failures++;
+	    }
+
+	    ice_key_destroy (ik);
+	}
+
+	free (pt);
+	free (ct1);
+	free (ct2);
+
+	return (failures);
+}
+
+
+/*
+ * Timing state.
+ */
+
+typedef struct {
+	struct timespec		ts;
+#ifdef HAVE_RDTSC
+	unsigned long long	tsc;
+#endif
+} BENCH_TIME;
+
+
+/*
+ * Record the current time.
+ */
+
+static void
+bench_now (
+	BENCH_TIME	*t
+) {
+	clock_gettime (CLOCK_MONOTONIC, &t->ts);
+#ifdef HAVE_RDTSC
+	t->tsc = __rdtsc ();
+#endif
+}
+
+
+/*
+ * Print the cost of n operations, each on nbytes of data, that took
+ * place between the two times.
+ */
+
+static void
+bench_report (
+	const char	*name,
+	const BENCH_TIME	*t0,
+	const BENCH_TIME	*t1,
+	unsigned long	n,
+	int		nbytes
+) {
+	double		secs = (t1->ts.tv_sec - t0->ts.tv_sec)
+				+ (t1->ts.tv_nsec - t0->ts.tv_nsec) / 1e9;
+
+#ifdef HAVE_RDTSC
+	printf ("  %-16s %10.1f cycles/op", name,
+				(double) (t1->tsc - t0->tsc) / n);
+#else
+	printf ("  %-16s %10.1f ns/op", name, secs * 1e9 / n);
+#endif
+
+	if (nbytes > 0 && secs > 0.0)
+	    printf ("  %8.2f MB/s", (double) n * nbytes / secs / 1e6);
+
+	printf ("\n");
+}
+
+
+/*
+ * Benchmark one ICE level.
+ */
+
+static void
+bench_level (
+	int		level,
+	unsigned long	iterations
+) {
+	ICE_KEY		*ik = ice_key_create (level);
+	unsigned char	key[1024];
+	unsigned char	*pt, *ct;
+	BENCH_TIME	t0, t1;
+	unsigned long	i, n;
+
+	pt = (unsigned char *) malloc (NBLOCKS * 8);
+	ct = (unsigned char *) malloc (NBLOCKS * 8);
+	if (ik == NULL || pt == NULL || ct == NULL) {
+	    printf ("Out of memory\n");
+	    exit (1);
+	}
+
+	fill_bytes (key, sizeof (key), level);
+	fill_bytes (pt, NBLOCKS * 8, level + 1000);
+
+	if (level == 0)
+	    printf ("Thin-ICE (8 rounds)\n");
+	else if (level == 1)
+	    printf ("ICE (16 rounds)\n");
+	else
+	    printf ("ICE-%d (%d rounds)\n", level, level * 16);
+
+			/* Fewer key setups at high levels */
+	n = iterations / 4 / (level + 1) + 1;
+	bench_now (&t0);
+	for (i=0; i<n; i++)
+	    ice_key_set (ik, key);
+	bench_now (&t1);
+	bench_report ("ice_key_set", &t0, &t1, n, 0);
+
+	n = iterations / (level + 1) / NBLOCKS + 1;
+
+	bench_now (&t0);
+	for (i=0; i<n * NBLOCKS; i++)
+	    ice_key_encrypt (ik, &pt[(i % NBLOCKS) * 8],
+						&ct[(i % NBLOCKS) * 8]);
+	bench_now (&t1);
+	bench_report ("encrypt", &t0, &t1, n * NBLOCKS, 8);
+
+	bench_now (&t0);
+	for (i=0; i<n; i++)
+	    ice_key_encrypt_blocks (ik, pt, ct, NBLOCKS);
+	bench_now (&t1);
+	bench_report ("encrypt_blocks", &t0, &t1, n * NBLOCKS, 8);
+
+	bench_now (&t0);
+	for (i=0; i<n * NBLOCKS; i++)
+	    ice_key_decrypt (ik, &ct[(i % NBLOCKS) * 8],
+						&pt[(i % NBLOCKS) * 8]);
+	bench_now (&t1);
+	bench_report ("decrypt", &t0, &t1, n * NBLOCKS, 8);
+
+	ice_key_destroy (ik);
+	free (pt);
+	free (ct);
+}
+
+
+/*
+ * Program's starting point.
+ */
+
+int
+main (
+	int		argc,
+	char		*argv[]
+) {
+	int		i, failures;
+	unsigned long	iterations = 2000000;
+
+	if (argc > 1 && sscanf (argv[1], "%lu", &iterations) != 1) {
+	    fprintf (stderr, "Usage: %s [iterations]\n", argv[0]);
+	    return 1;
+	}
+
+	if ((failures = kat_check ()) > 0) {
+	    printf ("%d known-answer test(s) failed\n", failures);
+	    return 1;
+	}
+	printf ("Known-answer tests passed\n\n");
+
+	for (i=0; i<(int) NLEVELS; i++)
+	    bench_level (bench_levels[i], iterations);
+
+	return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Generates the S-box tables for the ICE encryption algorithm.
+ *
+ * Copyright (C) 1999 Matthew Kwan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ *
+ * For license text, see https://spdx.org/licenses/Apache-2.0>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+	/* Modulo values for the S-boxes */
+static const int	ice_smod[4][4] = {
+				{333, 313, 505, 369},
+				{379, 375, 319, 391},
+				{361, 445, 451, 397},
+				{397, 425, 395, 505}};
+
+	/* XOR values for the S-boxes */
+static const int	ice_sxor[4][4] = {
+				{0x83, 0x85, 0x9b, 0xcd},
+				{0xcc, 0xa7, 0xad, 0x41},
+				{0x4b, 0x2e, 0xd4, 0x33},
+				{0xea, 0xcb, 0x2e, 0x04}};
+
+	/* Expanded permutation values for the P-box */
+static const uint32_t	ice_pbox[32] = {
+		0x00000001, 0x00000080, 0x00000400, 0x00002000,
+		0x00080000, 0x00200000, 0x01000000, 0x40000000,
+		0x00000008, 0x00000020, 0x00000100, 0x00004000,
+		0x00010000, 0x00800000, 0x04000000, 0x20000000,
+		0x00000004, 0x00000010, 0x00000200, 0x00008000,
+		0x00020000, 0x00400000, 0x08000000, 0x10000000,
+		0x00000002, 0x00000040, 0x00000800, 0x00001000,
+		0x00040000, 0x00100000, 0x02000000, 0x80000000};
+
+
+/*
+ * Galois Field multiplication of a by b, modulo m.
+ * Just like arithmetic multiplication, except that additions and
+ * subtractions are replaced by XOR.
+ */
+
+static unsigned int
+gf_mult (
+	register unsigned int	a,
+	register unsigned int	b,
+	register unsigned int	m
+) {
+	register unsigned int	res = 0;
+
+	while (b) {
+	    if (b & 1)
+		res ^= a;
+
+	    a <<= 1;
+	    b >>= 1;
+
+	    if (a >= 256)
+		a ^= m;
+	}
+
+	return (res);
+}
+
+
+/*
+ * Galois Field exponentiation.
+ * Raise the base to the power of 7, modulo m.
+ */
+
+static unsigned int
+gf_exp7 (
+	register unsigned int	b,
+	unsigned int		m
+) {
+	register unsigned int	x;
+
+	if (b == 0)
+	    return (0);
+
+	x = gf_mult (b, b, m);
+	x = gf_mult (b, x, m);
+	x = gf_mult (x, x, m);
+	return (gf_mult (b, x, m));
+}
+
+
+/*
+ * Carry out the ICE 32-bit P-box permutation.
+ */
+
+static uint32_t
+ice_perm32 (
+	register uint32_t	x
+) {
+	register uint32_t		res = 0;
+	register const uint32_t		*pbox = ice_pbox;
+
+	while (x) {
+	    if (x & 1)
+		res |= *pbox;
+	    pbox++;
+	    x >>= 1;
+	}
+
+	return (res);
+}
+
+
+/*
+ * Calculate the ICE S-boxes and write them to stdout as C initialisers.
+ */
+
+int
+main (void)
+{
+	int		i, n;
+
+	printf ("/*\n * Generated by icegen - do not edit.\n");
+	printf (" * The ICE S-boxes, with the P-box permutation applied.\n */\n\n");
+
+	for (n=0; n<4; n++) {
+	    printf ("{\n");
+
+	    for (i=0; i<1024; i++) {
+		int		col = (i >> 1) & 0xff;
+		int		row = (i & 0x1) | ((i & 0x200) >> 8);
+		uint32_t	x;
+
+		x = gf_exp7 (col ^ ice_sxor[n][row], ice_smod[n][row])
+							<< (24 - n * 8);
+
+		printf ("%s0x%08lx,%s", (i & 3) == 0 ? "\t" : " ",
+			(unsigned long) ice_perm32 (x), (i & 3) == 3 ? "\n" : "");
+	    }
+
+	    printf ("},\n");
+	}
+
+	return 0;
+}
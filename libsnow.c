@@ -0,0 +1,823 @@
+/*
+ * Library interface for the SNOW steganography program.
+ *
+ * Copyright (C) 1999 Matthew Kwan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ *
+ * For license text, see https://spdx.org/licenses/Apache-2.0>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "snow.h"
+
+
+/*
+ * Create a context with the default settings.
+ */
+
+SNOW_CTX *
+snow_ctx_create (void)
+{
+	SNOW_CTX	*ctx;
+
+	if ((ctx = (SNOW_CTX *) calloc (1, sizeof (SNOW_CTX))) == NULL)
+	    return (NULL);
+
+	ctx->compress_flag = FALSE;
+	ctx->quiet_flag = FALSE;
+	ctx->line_length = 80;
+	ctx->ice_level = -1;
+	ctx->cipher_mode = CIPHER_CFB;
+	ctx->cipher_mode_set = FALSE;
+	ctx->threads = 0;
+	ctx->header_flag = FALSE;
+	ctx->strict_flag = FALSE;
+	ctx->append_plain = FALSE;
+	ctx->dense_flag = FALSE;
+	ctx->carriers = CARRIER_WS;
+	ctx->ice_key = NULL;
+	ctx->decrypt_buf = NULL;
+
+	return (ctx);
+}
+
+
+/*
+ * Destroy a context, and everything it holds.
+ */
+
+void
+snow_ctx_destroy (
+	SNOW_CTX	*ctx
+) {
+	if (ctx == NULL)
+	    return;
+
+	encrypt_destroy (ctx);
+	encode_destroy (ctx);
+	free (ctx);
+}
+
+
+/*
+ * Turn compression on or off.
+ */
+
+void
+snow_set_compress (
+	SNOW_CTX	*ctx,
+	int		flag
+) {
+	ctx->compress_flag = (flag != 0);
+}
+
+
+/*
+ * Turn warnings and statistics on or off.
+ */
+
+void
+snow_set_quiet (
+	SNOW_CTX	*ctx,
+	int		flag
+) {
+	ctx->quiet_flag = (flag != 0);
+}
+
+
+/*
+ * Set the maximum line length. Returns 0 if it is too short.
+ */
+
+int
+snow_set_line_length (
+	SNOW_CTX	*ctx,
+	int		len
+) {
+	if (len < 8)
+	    return (0);
+
+	ctx->line_length = len;
+	return (1);
+}
+
+
+/*
+ * Set the ICE level to derive from the password, or -1 to use the
+ * original password packing. Returns 0 if the level is illegal.
+ */
+
+int
+snow_set_ice_level (
+	SNOW_CTX	*ctx,
+	int		level
+) {
+	if (level < -1 || level > 128)
+	    return (0);
+
+	ctx->ice_level = level;
+	return (1);
+}
+
+
+/*
+ * Set the cipher mode. Returns 0 if the mode is unknown.
+ */
+
+int
+snow_set_cipher_mode (
+	SNOW_CTX	*ctx,
+	int		mode
+) {
+	if (mode != CIPHER_CFB && mode != CIPHER_CTR)
+	    return (0);
+
+	ctx->cipher_mode = mode;
+	ctx->cipher_mode_set = TRUE;
+	return (1);
+}
+
+
+/*
+ * Set the number of threads used for extraction, and for concealing
+ * with dense lines.
+ */
+
+void
+snow_set_threads (
+	SNOW_CTX	*ctx,
+	int		n
+) {
+	ctx->threads = (n > 0) ? n : 0;
+}
+
+
+/*
+ * Turn the length header on or off.
+ */
+
+void
+snow_set_header (
+	SNOW_CTX	*ctx,
+	int		flag
+) {
+	ctx->header_flag = (flag != 0);
+}
+
+
+/*
+ * Say whether a message without a header, when appended to, is known
+ * not to be compressed. Nothing in the text records it, and carrying
+ * on from a compressed one would make it unreadable.
+ */
+
+void
+snow_set_append_plain (
+	SNOW_CTX	*ctx,
+	int		flag
+) {
+	ctx->append_plain = (flag != 0);
+}
+
+
+/*
+ * Turn on or off the refusal of messages that don't fit in the text.
+ */
+
+void
+snow_set_strict (
+	SNOW_CTX	*ctx,
+	int		flag
+) {
+	ctx->strict_flag = (flag != 0);
+}
+
+
+/*
+ * Turn the dense encoding on or off.
+ */
+
+void
+snow_set_dense (
+	SNOW_CTX	*ctx,
+	int		flag
+) {
+	ctx->dense_flag = (flag != 0);
+}
+
+
+/*
+ * Set the carriers used to conceal data. Returns 0 if there are none,
+ * or any are unknown.
+ */
+
+int
+snow_set_carriers (
+	SNOW_CTX	*ctx,
+	int		carriers
+) {
+	if (carriers == 0
+		|| (carriers & ~(CARRIER_WS | CARRIER_ZW | CARRIER_EOL)) != 0)
+	    return (0);
+
+	ctx->carriers = carriers;
+	return (1);
+}
+
+
+/*
+ * Set the size of the chunks in a chunk index, or 0 for no index.
+ * Returns 0 if it isn't a multiple of 8 that the header can hold.
+ */
+
+int
+snow_set_chunk_size (
+	SNOW_CTX	*ctx,
+	size_t		size
+) {
+	if (size % 8 != 0 || size > 0xffffffffUL)
+	    return (0);
+
+	ctx->chunk_size = size;
+	return (1);
+}
+
+
+/*
+ * Set the password used to encrypt and decrypt.
+ */
+
+void
+snow_set_password (
+	SNOW_CTX	*ctx,
+	const char	*passwd
+) {
+	password_set (ctx, passwd);
+}
+
+
+/*
+ * Close a file writer once an operation is over, reporting any
+ * failure to write out the last of its buffer.
+ */
+
+static BOOL
+writer_finish (
+	SNOW_WRITER	*w,
+	BOOL		ok,
+	const char	*name
+) {
+	if (!writer_close (w) && ok) {
+	    perror (name);
+	    return (FALSE);
+	}
+
+	return (ok);
+}
+
+
+/*
+ * Check, before anything is written, whether a message with the given
+ * number of data bits will fit in the rest of the text. Warns if it may
+ * not, and returns FALSE if it doesn't and must. If the size of the
+ * message isn't known, or the text can't be mapped into memory, or
+ * whether it fits depends on the data, the output is held back until
+ * the message is known to fit. With a chunk index the text must be
+ * mapped, and isn't planned, since the lines the header leaves unused
+ * depend on the index.
+ */
+
+static BOOL
+encode_check (
+	SNOW_CTX	*ctx,
+	unsigned long	bits,
+	BOOL		known,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf
+) {
+	SNOW_READER	map, *r = inf;
+	unsigned long	lo, hi;
+	int		plan = PLAN_MAY_NOT_FIT;
+
+	if (dense_used (ctx) && ctx->line_length > DENSE_LINE_MAX) {
+	    fprintf (stderr,
+		"Error: line length too long for the dense encoding.\n");
+	    return (FALSE);
+	}
+
+	if (ctx->chunk_size > 0 && ctx->compress_flag) {
+	    fprintf (stderr,
+		"Error: a chunk index can't be used with compression.\n");
+	    return (FALSE);
+	}
+
+	if (ctx->chunk_size > 0 && ctx->cipher_mode_set
+				&& ctx->cipher_mode != CIPHER_CTR) {
+	    fprintf (stderr, "Error: a chunk index needs counter mode.\n");
+	    return (FALSE);
+	}
+
+	if ((known || ctx->chunk_size > 0) && inf->fp != NULL)
+	    r = reader_map_init (&map, inf->fp) ? &map : NULL;
+
+	if (ctx->chunk_size > 0 && r == NULL) {
+	    fprintf (stderr,
+			"Error: a chunk index needs a text file to seek in.\n");
+	    return (FALSE);
+	}
+
+	if (known && r != NULL && ctx->chunk_size == 0) {
+	    bits += encrypt_header_size (ctx);
+	    plan = encode_plan (ctx, r, bits, &lo, &hi);
+
+	    if (plan == PLAN_WONT_FIT && ctx->strict_flag) {
+		fprintf (stderr,
+	"Error: message needs %lu bits, but the text has room for at most %lu.\n",
+								bits, hi);
+	    } else if (plan == PLAN_WONT_FIT && !ctx->quiet_flag) {
+		fprintf (stderr,
+	"Warning: message needs %lu bits, but the text has room for at most %lu.\n",
+								bits, hi);
+	    } else if (plan == PLAN_MAY_NOT_FIT && !ctx->quiet_flag) {
+		fprintf (stderr,
+"Warning: message needs %lu bits, and the text has room for %lu to %lu.\n",
+							bits, lo, hi);
+	    }
+	}
+
+	if (r == &map)
+	    reader_close (&map);
+
+	if (plan == PLAN_WONT_FIT && ctx->strict_flag)
+	    return (FALSE);
+
+	outf->hold = (ctx->strict_flag && plan != PLAN_FITS);
+
+	return (TRUE);
+}
+
+
+/*
+ * Find the number of data bits in a message file, leaving it where it
+ * was. Returns FALSE if the file can't be read twice.
+ */
+
+static BOOL
+message_file_size (
+	SNOW_CTX	*ctx,
+	FILE		*fp,
+	unsigned long	*bits
+) {
+	long		pos;
+	size_t		n;
+	unsigned char	buf[BUFSIZ];
+
+	if ((pos = ftell (fp)) < 0)
+	    return (FALSE);
+
+	*bits = 0;
+	while ((n = fread (buf, 1, BUFSIZ, fp)) > 0)
+	    *bits += compress_size (ctx, buf, n);
+
+	clearerr (fp);
+
+	return (fseek (fp, pos, SEEK_SET) == 0);
+}
+
+
+/*
+ * Conceal a buffer of bytes, reading and writing the text with
+ * the streams given, carrying on from ap if it is not NULL.
+ */
+
+static BOOL
+encode_stream (
+	SNOW_CTX	*ctx,
+	const void	*msg,
+	size_t		len,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf,
+	const SNOW_APPEND	*ap
+) {
+	if (!encode_check (ctx, compress_size (ctx,
+			(const unsigned char *) msg, len), TRUE, inf, outf))
+	    return (FALSE);
+
+	compress_init (ctx);
+
+	if (ap != NULL && !encode_resume (ctx, ap, inf, outf))
+	    return (FALSE);
+
+	if (!compress_bytes (ctx, (const unsigned char *) msg, len, inf, outf))
+	    return (FALSE);
+
+	return (compress_flush (ctx, inf, outf));
+}
+
+
+/*
+ * Conceal the contents of a file, reading and writing the text with
+ * the streams given, carrying on from ap if it is not NULL.
+ */
+
+static BOOL
+encode_file_stream (
+	SNOW_CTX	*ctx,
+	FILE		*msg_fp,
+	SNOW_READER	*inf,
+	SNOW_WRITER	*outf,
+	const SNOW_APPEND	*ap
+) {
+	size_t		n;
+	unsigned char	buf[BUFSIZ];
+	unsigned long	bits = 0;
+	BOOL		known = message_file_size (ctx, msg_fp, &bits);
+
+	if (!encode_check (ctx, bits, known, inf, outf))
+	    return (FALSE);
+
+	compress_init (ctx);
+
+	if (ap != NULL && !encode_resume (ctx, ap, inf, outf))
+	    return (FALSE);
+
+	while ((n = fread (buf, 1, BUFSIZ, msg_fp)) > 0)
+	    if (!compress_bytes (ctx, buf, n, inf, outf))
+		return (FALSE);
+
+	if (ferror (msg_fp) != 0) {
+	    perror ("Message file");
+	    return (FALSE);
+	}
+
+	return (compress_flush (ctx, inf, outf));
+}
+
+
+/*
+ * Conceal a message in a file, rewriting the start of the file up to
+ * the last line that was changed. The message is either a buffer or,
+ * if msg_fp is not NULL, the contents of a file. A header is always
+ * written, since the lines after the message are left as they were,
+ * trailing whitespace included.
+ */
+
+static BOOL
+encode_inplace (
+	SNOW_CTX	*ctx,
+	const void	*msg,
+	size_t		len,
+	FILE		*msg_fp,
+	FILE		*fp
+) {
+	SNOW_READER	r;
+	SNOW_WRITER	w;
+	BOOL		header_flag = ctx->header_flag;
+	BOOL		ok;
+
+	reader_file_init (&r, fp);
+	writer_mem_init (&w);
+
+	ctx->header_flag = TRUE;
+	ctx->encode_inplace = TRUE;
+
+	if (msg_fp != NULL)
+	    ok = encode_file_stream (ctx, msg_fp, &r, &w, NULL);
+	else
+	    ok = encode_stream (ctx, msg, len, &r, &w, NULL);
+
+	ctx->header_flag = header_flag;
+	ctx->encode_inplace = FALSE;
+
+	if (ok && !file_replace (fp, 0, w.buf, w.len)) {
+	    perror ("Text output");
+	    ok = FALSE;
+	}
+
+	free (w.buf);
+
+	return (ok);
+}
+
+
+/*
+ * Conceal a message after one already in a file, rewriting the file
+ * from where that one ends up to the last line that was changed. The
+ * message is either a buffer or, if msg_fp is not NULL, the contents
+ * of a file. After a message with a length header another segment is
+ * started, with a header of its own. A message without one is carried
+ * on part way through its last line, so what is appended to it can't
+ * be compressed, or be given a header, dense lines or counter mode,
+ * and it must be known not to have been compressed itself.
+ */
+
+static BOOL
+encode_append (
+	SNOW_CTX	*ctx,
+	const void	*msg,
+	size_t		len,
+	FILE		*msg_fp,
+	FILE		*fp
+) {
+	SNOW_READER	r;
+	SNOW_WRITER	w;
+	SNOW_APPEND	ap;
+	BOOL		header_flag = ctx->header_flag;
+	BOOL		ok;
+
+	if (!reader_map_init (&r, fp)) {
+	    fprintf (stderr, "Error: appending needs a text file to seek in.\n");
+	    return (FALSE);
+	}
+
+	ok = message_locate (ctx, &r, &ap);
+	r.pos = ap.pos;
+	if (ok && !reader_map_seek (&r, fp)) {
+	    perror ("Text input");
+	    ok = FALSE;
+	}
+	reader_close (&r);
+
+	if (ok && !ap.segment && !ctx->append_plain) {
+	    fprintf (stderr,
+"Error: the message has no header, so it may have been compressed.\n");
+	    ok = FALSE;
+	} else if (ok && !ap.segment && (ctx->compress_flag || ctx->header_flag
+			|| dense_used (ctx) || ctx->cipher_mode != CIPHER_CFB)) {
+	    fprintf (stderr,
+"Error: the message has no header, so only the same encoding can follow it.\n");
+	    ok = FALSE;
+	}
+
+	if (!ok) {
+	    free (ap.bits);
+	    return (FALSE);
+	}
+
+	reader_file_init (&r, fp);
+	writer_mem_init (&w);
+
+	ctx->header_flag = ap.segment;
+	ctx->encode_inplace = TRUE;
+
+	if (msg_fp != NULL)
+	    ok = encode_file_stream (ctx, msg_fp, &r, &w, &ap);
+	else
+	    ok = encode_stream (ctx, msg, len, &r, &w, &ap);
+
+	ctx->header_flag = header_flag;
+	ctx->encode_inplace = FALSE;
+
+	if (ok && !file_replace (fp, ap.pos, w.buf, w.len)) {
+	    perror ("Text output");
+	    ok = FALSE;
+	}
+
+	free (w.buf);
+	free (ap.bits);
+
+	return (ok);
+}
+
+
+/*
+ * Conceal a buffer of bytes.
+ */
+
+int
+snow_encode (
+	SNOW_CTX	*ctx,
+	const void	*msg,
+	size_t		len,
+	FILE		*inf,
+	FILE		*outf
+) {
+	SNOW_READER	r;
+	SNOW_WRITER	w;
+
+	reader_file_init (&r, inf);
+	writer_file_init (&w, outf);
+
+	return (writer_finish (&w, encode_stream (ctx, msg, len, &r, &w, NULL),
+							"Text output"));
+}
+
+
+/*
+ * Conceal the contents of a file.
+ */
+
+int
+snow_encode_file (
+	SNOW_CTX	*ctx,
+	FILE		*msg_fp,
+	FILE		*inf,
+	FILE		*outf
+) {
+	SNOW_READER	r;
+	SNOW_WRITER	w;
+
+	reader_file_init (&r, inf);
+	writer_file_init (&w, outf);
+
+	return (writer_finish (&w, encode_file_stream (ctx, msg_fp, &r, &w,
+						NULL), "Text output"));
+}
+
+
+/*
+ * Conceal a buffer of bytes in a file, in place.
+ */
+
+int
+snow_encode_inplace (
+	SNOW_CTX	*ctx,
+	const void	*msg,
+	size_t		len,
+	FILE		*fp
+) {
+	return (encode_inplace (ctx, msg, len, NULL, fp));
+}
+
+
+/*
+ * Conceal the contents of a file in another file, in place.
+ */
+
+int
+snow_encode_file_inplace (
+	SNOW_CTX	*ctx,
+	FILE		*msg_fp,
+	FILE		*fp
+) {
+	return (encode_inplace (ctx, NULL, 0, msg_fp, fp));
+}
+
+
+/*
+ * Append a buffer of bytes to a message concealed in a file.
+ */
+
+int
+snow_append (
+	SNOW_CTX	*ctx,
+	const void	*msg,
+	size_t		len,
+	FILE		*fp
+) {
+	return (encode_append (ctx, msg, len, NULL, fp));
+}
+
+
+/*
+ * Append the contents of a file to a message concealed in another file.
+ */
+
+int
+snow_append_file (
+	SNOW_CTX	*ctx,
+	FILE		*msg_fp,
+	FILE		*fp
+) {
+	return (encode_append (ctx, NULL, 0, msg_fp, fp));
+}
+
+
+/*
+ * Conceal a buffer of bytes in a buffer of text, without using stdio.
+ * On success *out points to a buffer holding *out_len bytes of text,
+ * which the caller must free().
+ */
+
+int
+snow_encode_mem (
+	SNOW_CTX	*ctx,
+	const void	*msg,
+	size_t		len,
+	const char	*text,
+	size_t		text_len,
+	char		**out,
+	size_t		*out_len
+) {
+	SNOW_READER	r;
+	SNOW_WRITER	w;
+
+	reader_mem_init (&r, text, text_len);
+	writer_mem_init (&w);
+
+	if (!encode_stream (ctx, msg, len, &r, &w, NULL)) {
+	    free (w.buf);
+	    return (0);
+	}
+
+	*out = w.buf;
+	*out_len = w.len;
+
+	return (1);
+}
+
+
+/*
+ * Extract a concealed message. Regular files are mapped into memory
+ * rather than read a line at a time.
+ */
+
+int
+snow_extract (
+	SNOW_CTX	*ctx,
+	FILE		*inf,
+	FILE		*outf
+) {
+	SNOW_READER	r;
+	SNOW_WRITER	w;
+	BOOL		ok;
+
+	reader_map_init (&r, inf);
+	writer_file_init (&w, outf);
+
+	ok = message_extract (ctx, &r, &w);
+	reader_close (&r);
+
+	return (writer_finish (&w, ok, "Output file"));
+}
+
+
+/*
+ * Extract len bytes of a concealed message, starting off bytes in.
+ */
+
+int
+snow_extract_range (
+	SNOW_CTX	*ctx,
+	FILE		*inf,
+	FILE		*outf,
+	size_t		off,
+	size_t		len
+) {
+	SNOW_READER	r;
+	SNOW_WRITER	w;
+
+	reader_file_init (&r, inf);
+	writer_file_init (&w, outf);
+
+	return (writer_finish (&w, message_extract_range (ctx, &r, &w, off,
+							len), "Output file"));
+}
+
+
+/*
+ * Extract a concealed message from a buffer of text, without using
+ * stdio. On success *msg points to a buffer holding *msg_len bytes,
+ * which the caller must free().
+ */
+
+int
+snow_extract_mem (
+	SNOW_CTX	*ctx,
+	const char	*text,
+	size_t		text_len,
+	void		**msg,
+	size_t		*msg_len
+) {
+	SNOW_READER	r;
+	SNOW_WRITER	w;
+
+	reader_mem_init (&r, text, text_len);
+	writer_mem_init (&w);
+
+	if (!message_extract (ctx, &r, &w)) {
+	    free (w.buf);
+	    return (0);
+	}
+
+	*msg = w.buf;
+	*msg_len = w.len;
+
+	return (1);
+}
+
+
+/*
+ * Report the space available for a message.
+ */
+
+void
+snow_space (
+	SNOW_CTX	*ctx,
+	FILE		*inf
+) {
+	SNOW_READER	r;
+
+	reader_file_init (&r, inf);
+	space_calculate (ctx, &r);
+}
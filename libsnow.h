@@ -0,0 +1,205 @@
+/*
+ * Public header file for the SNOW steganography library.
+ *
+ * Copyright (C) 1999 Matthew Kwan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ *
+ * For license text, see https://spdx.org/licenses/Apache-2.0>.
+ *
+ * DESCRIPTION
+ *
+ * All the state used to conceal or extract a message is held in a
+ * SNOW_CTX, so any number of contexts can be used at once, each by
+ * one thread at a time. A context can be reused for further messages
+ * once an operation on it has finished.
+ *
+ * The functions returning int return 1 on success and 0 on failure,
+ * with error messages written to stderr.
+ */
+
+#ifndef _LIBSNOW_H
+#define _LIBSNOW_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * The context, whose contents are private to the library.
+ */
+
+typedef struct snow_ctx_struct	SNOW_CTX;
+
+
+/*
+ * Cipher modes.
+ */
+
+#define SNOW_CIPHER_CFB		0	/* 1-bit cipher feedback */
+#define SNOW_CIPHER_CTR		1	/* 64-bit counter */
+
+
+/*
+ * Carriers, which can be combined. Each line of the text can carry
+ * data in its trailing whitespace, in zero-width Unicode characters
+ * at its end, and in whether it ends with CRLF or LF.
+ */
+
+#define SNOW_CARRIER_WS		0x01
+#define SNOW_CARRIER_ZW		0x02
+#define SNOW_CARRIER_EOL	0x04
+
+
+/*
+ * Create and destroy contexts.
+ * A new context has the same settings as the snow program's defaults.
+ */
+
+extern SNOW_CTX	*snow_ctx_create (void);
+extern void	snow_ctx_destroy (SNOW_CTX *ctx);
+
+
+/*
+ * Change a context's settings. The password must be set after the
+ * ICE level, since the level is used to derive the key from it.
+ * The level isn't recorded with a message, so extracting it needs the
+ * level it was concealed with.
+ * With the header flag set, concealed data starts with a header
+ * holding its length and whether it is compressed.
+ * The thread count sets how many threads extraction uses. Zero, the
+ * default, decodes the text in one thread and decrypts with one thread
+ * per processor. Concealing with dense lines uses more than one thread
+ * only if asked to, and the output is the same either way.
+ * With the strict flag set, a message that doesn't fit in the text is
+ * refused, with nothing written, rather than extra lines being added.
+ * With the dense flag set, a header is always written, and the lines
+ * after it store as many bits as their free columns allow. Extraction
+ * takes the line length from the header. Carriers other than trailing
+ * whitespace also use dense lines. Setting no carriers is an error.
+ * With a chunk size set, the header also holds an index of where each
+ * chunk of that many bytes starts, so a range of the message can be
+ * extracted without decoding the rest. The size must be a multiple of
+ * 8, and zero, the default, means no index. An index implies dense
+ * lines, can't be used with compression, needs counter mode if there
+ * is a password, and needs a text in a file that can be mapped into
+ * memory.
+ */
+
+extern void	snow_set_compress (SNOW_CTX *ctx, int flag);
+extern void	snow_set_quiet (SNOW_CTX *ctx, int flag);
+extern int	snow_set_line_length (SNOW_CTX *ctx, int len);
+extern int	snow_set_ice_level (SNOW_CTX *ctx, int level);
+extern int	snow_set_cipher_mode (SNOW_CTX *ctx, int mode);
+extern void	snow_set_threads (SNOW_CTX *ctx, int n);
+extern void	snow_set_header (SNOW_CTX *ctx, int flag);
+extern void	snow_set_append_plain (SNOW_CTX *ctx, int flag);
+extern void	snow_set_strict (SNOW_CTX *ctx, int flag);
+extern void	snow_set_dense (SNOW_CTX *ctx, int flag);
+extern int	snow_set_carriers (SNOW_CTX *ctx, int carriers);
+extern int	snow_set_chunk_size (SNOW_CTX *ctx, size_t size);
+extern void	snow_set_password (SNOW_CTX *ctx, const char *passwd);
+
+
+/*
+ * Conceal a message in the text read from inf, writing the result
+ * to outf. The message is either a buffer or the contents of a file.
+ */
+
+extern int	snow_encode (SNOW_CTX *ctx, const void *msg, size_t len,
+						FILE *inf, FILE *outf);
+extern int	snow_encode_file (SNOW_CTX *ctx, FILE *msg_fp,
+						FILE *inf, FILE *outf);
+
+
+/*
+ * Conceal a message in a file opened for reading and writing, changing
+ * only the start of it up to the last line holding the message. The
+ * rest of the file is moved if the start changes length. A length
+ * header is always used, whatever the header setting. The file is
+ * inconsistent if this fails part way.
+ */
+
+extern int	snow_encode_inplace (SNOW_CTX *ctx, const void *msg,
+						size_t len, FILE *fp);
+extern int	snow_encode_file_inplace (SNOW_CTX *ctx, FILE *msg_fp,
+								FILE *fp);
+
+
+/*
+ * Append a message to one already concealed in a file opened for
+ * reading and writing, changing only the lines from where that one
+ * ends. Both are extracted as one message. After a message with a
+ * length header, the new one is concealed with the settings given and
+ * a header of its own. A message without one is carried on from part
+ * way through its last line, so the new one can't be compressed or
+ * given a header, dense lines or counter mode, and it is refused
+ * unless snow_set_append_plain() says the old one wasn't compressed.
+ * The file is inconsistent if this fails part way.
+ */
+
+extern int	snow_append (SNOW_CTX *ctx, const void *msg, size_t len,
+								FILE *fp);
+extern int	snow_append_file (SNOW_CTX *ctx, FILE *msg_fp, FILE *fp);
+
+
+/*
+ * Conceal a message in a buffer of text held in memory. On success
+ * *out is set to a buffer of *out_len bytes, to be released with free().
+ */
+
+extern int	snow_encode_mem (SNOW_CTX *ctx, const void *msg, size_t len,
+				const char *text, size_t text_len,
+				char **out, size_t *out_len);
+
+
+/*
+ * Extract a concealed message from inf, writing it to outf.
+ */
+
+extern int	snow_extract (SNOW_CTX *ctx, FILE *inf, FILE *outf);
+
+
+/*
+ * Extract len bytes of a concealed message from inf, starting off bytes
+ * in, and write them to outf. Bytes past the end of the message are
+ * left out. If the message has a chunk index and inf can be mapped into
+ * memory, only the lines holding the bytes wanted are decoded.
+ */
+
+extern int	snow_extract_range (SNOW_CTX *ctx, FILE *inf, FILE *outf,
+						size_t off, size_t len);
+
+
+/*
+ * Extract a concealed message from a buffer of text held in memory.
+ * On success *msg is set to a buffer of *msg_len bytes, to be released
+ * with free().
+ */
+
+extern int	snow_extract_mem (SNOW_CTX *ctx, const char *text,
+			size_t text_len, void **msg, size_t *msg_len);
+
+
+/*
+ * Report the space available for a message in the text read from inf.
+ */
+
+extern void	snow_space (SNOW_CTX *ctx, FILE *inf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
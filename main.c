@@ -19,119 +19,89 @@
  * Command-line program for hiding and extracting messages within
  * the whitespace of text files.
  *
- * Usage: snow [-C][-Q][-S][-p passwd][-l line-len] [-f file | -m message]
- *					[infile [outfile]]
+ * Usage: snow [-C][-D][-F][-H][-Q][-S][-a|-A|-i][-p passwd][-L level]
+ *		[-M mode] [-l line-len] [-j threads] [-t carriers]
+ *		[-X chunk-size]
+ *		[-f file | -m message | --range offset:length]
+ *		[infile [outfile]]
  *
  *	-C : Use compression
+ *	-D : Use the dense encoding
+ *	-F : Fail if the message doesn't fit in the text
+ *	-H : Write a header holding the message length
  *	-Q : Be quiet
  *	-S : Calculate the space available in the file
+ *	-a : Append the message to the one concealed in infile
+ *	-A : Append, to a message without a header that isn't compressed
+ *	-i : Conceal the message in infile itself
+ *	-L : ICE level to derive from the password
+ *	-M : Cipher mode, cfb or ctr
  *	-l : Maximum line length allowable
+ *	-j : Number of threads to use
+ *	-t : Carriers to use, a list of ws, zw and eol
+ *	-X : Bytes per chunk in a chunk index for partial extraction
  *	-p : Specify the password to encrypt the message
  *
  *	-f : Insert the message contained in the file
  *	-m : Insert the message given
+ *	--range : Extract only length bytes of the message from offset
  *
  * If the program is executed without either of the -f or -m options
  * then the program will attempt to extract a concealed message.
  * The output will go to outfile if specified, stdout otherwise.
  */
 
-#include "snow.h"
-
-
-/*
- * Declaration of global variables.
- */
+#include <string.h>
 
-BOOL	compress_flag = FALSE;
-BOOL	quiet_flag = FALSE;
-int	line_length = 80;
-
-
-/*
- * Encode a single character.
- */
-
-static BOOL
-character_encode (
-	unsigned char	c,
-	FILE		*infile,
-	FILE		*outfile
-) {
-	int		i;
-
-	for (i=0; i<8; i++) {
-	    int		bit = ((c & (128 >> i)) != 0) ? 1 : 0;
-
-	    if (!compress_bit (bit, infile, outfile))
-		return (FALSE);
-	}
-
-	return (TRUE);
-}
+#include "snow.h"
 
 
 /*
- * Encode a string of characters.
+ * Display usage.
  */
 
-static BOOL
-message_string_encode (
-	const char	*msg,
-	FILE		*infile,
-	FILE		*outfile
+static void
+showUsage (
+	const char	*argv0
 ) {
-	compress_init ();
-
-	while (*msg != '\0') {
-	    if (!character_encode (*msg, infile, outfile))
-		return (FALSE);
-	    msg++;
-	}
-
-	return (compress_flush (infile, outfile));
+	printf ("Usage: %s [-C] [-D] [-F] [-H] [-Q] [-S] [-V | --version] [-h | --help]\n",
+								argv0);
+	printf ("\t[-a | -A | -i] [-p passwd] [-L level] [-M cfb | ctr]\n");
+	printf ("\t[-l line-len] [-j threads] [-t ws,zw,eol] [-X chunk-size]\n");
+	printf ("\t[-f file | -m message | --range offset:length]\n");
+	printf ("\t[infile [outfile]]\n");
 }
 
 
 /*
- * Encode the contents of a file.
+ * Parse a comma-separated list of carrier names.
+ * Returns 0 if any name is unknown.
  */
 
-static BOOL
-message_fp_encode (
-	FILE		*msg_fp,
-	FILE		*infile,
-	FILE		*outfile
+static int
+carriers_parse (
+	const char	*s
 ) {
-	int		c;
-
-	compress_init ();
-
-	while ((c = fgetc (msg_fp)) != EOF)
-	    if (!character_encode (c, infile, outfile))
-		return (FALSE);
-
-	if (ferror (msg_fp) != 0) {
-	    perror ("Message file");
-	    return (FALSE);
+	int		carriers = 0;
+
+	while (*s != '\0') {
+	    size_t	n = strcspn (s, ",");
+
+	    if (n == 2 && strncmp (s, "ws", n) == 0)
+		carriers |= SNOW_CARRIER_WS;
+	    else if (n == 2 && strncmp (s, "zw", n) == 0)
+		carriers |= SNOW_CARRIER_ZW;
+	    else if (n == 3 && strncmp (s, "eol", n) == 0)
+		carriers |= SNOW_CARRIER_EOL;
+	    else
+		return (0);
+
+	    s += n;
+	    if (*s == ',')
+		s++;
 	}
 
-	return (compress_flush (infile, outfile));
-}
-
-
-/*
- * Display usage.
- */
-
-static void
-showUsage (
-	const char	*argv0
-) {
-	printf ("Usage: %s [-C] [-Q] [-S] [-V | --version] [-h | --help]\n",
-								argv0);
-	printf ("\t[-p passwd] [-l line-len] [-f file | -m message]\n");
-	printf ("\t[infile [outfile]]\n");
+	return (carriers);
 }
 
 
@@ -156,15 +126,25 @@ main (
 	int		argc,
 	char		*argv[]
 ) {
-	int		c;
+	int		c, n;
 	int		optind;
 	BOOL		errflag = FALSE;
 	BOOL		space_flag = FALSE;
+	BOOL		inplace_flag = FALSE;
+	BOOL		append_flag = FALSE;
+	BOOL		range_flag = FALSE;
+	unsigned long	range_off, range_len;
 	char		*passwd = NULL;
 	char		*message_string = NULL;
 	FILE		*message_fp = NULL;
 	FILE		*infile = stdin;
 	FILE		*outfile = stdout;
+	SNOW_CTX	*ctx;
+
+	if ((ctx = snow_ctx_create ()) == NULL) {
+	    fprintf (stderr, "Error: out of memory\n");
+	    return 1;
+	}
 
 	optind = 1;
 	for (optind = 1; optind < argc
@@ -183,14 +163,43 @@ main (
 	    } else if (strcmp (argv[optind], "--version") == 0) {
 		showVersion ();
 		return 0;
+	    } else if (strncmp (argv[optind], "--range", 7) == 0) {
+		char	junk;
+
+		if (argv[optind][7] == '=')
+		    optarg = &argv[optind][8];
+		else if (argv[optind][7] != '\0' || ++optind == argc) {
+		    errflag = TRUE;
+		    break;
+		} else
+		    optarg = argv[optind];
+
+		if (sscanf (optarg, "%lu:%lu%c", &range_off, &range_len,
+								&junk) != 2) {
+		    fprintf (stderr, "Illegal range '%s'\n", optarg);
+		    errflag = TRUE;
+		    break;
+		}
+
+		range_flag = TRUE;
+		continue;
 	    }
 
 	    switch (c) {
 		case 'C':
-		    compress_flag = TRUE;
+		    snow_set_compress (ctx, TRUE);
+		    break;
+		case 'D':
+		    snow_set_dense (ctx, TRUE);
+		    break;
+		case 'F':
+		    snow_set_strict (ctx, TRUE);
+		    break;
+		case 'H':
+		    snow_set_header (ctx, TRUE);
 		    break;
 		case 'Q':
-		    quiet_flag = TRUE;
+		    snow_set_quiet (ctx, TRUE);
 		    break;
 		case 'S':
 		    space_flag = TRUE;
@@ -215,6 +224,48 @@ main (
 		case 'h':
 		    showUsage (argv[0]);
 		    return 0;
+		case 'a':
+		    append_flag = TRUE;
+		    break;
+		case 'A':
+		    snow_set_append_plain (ctx, TRUE);
+		    append_flag = TRUE;
+		    break;
+		case 'i':
+		    inplace_flag = TRUE;
+		    break;
+		case 'j':
+		    if (argv[optind][2] != '\0')
+			optarg = &argv[optind][2];
+		    else if (++optind == argc) {
+			errflag = TRUE;
+			break;
+		    } else
+			optarg = argv[optind];
+
+		    if (sscanf (optarg, "%d", &n) != 1 || n < 1) {
+			fprintf (stderr, "Illegal thread count '%s'\n",
+								optarg);
+			errflag = TRUE;
+		    } else
+			snow_set_threads (ctx, n);
+		    break;
+		case 'L':
+		    if (argv[optind][2] != '\0')
+			optarg = &argv[optind][2];
+		    else if (++optind == argc) {
+			errflag = TRUE;
+			break;
+		    } else
+			optarg = argv[optind];
+
+		    if (sscanf (optarg, "%d", &n) != 1 || n < 0
+					|| !snow_set_ice_level (ctx, n)) {
+			fprintf (stderr, "Illegal ICE level value '%s'\n",
+								optarg);
+			errflag = TRUE;
+		    }
+		    break;
 		case 'l':
 		    if (argv[optind][2] != '\0')
 			optarg = &argv[optind][2];
@@ -224,13 +275,31 @@ main (
 		    } else
 			optarg = argv[optind];
 
-		    if (sscanf (optarg, "%d", &line_length) != 1
-							|| line_length < 8) {
+		    if (sscanf (optarg, "%d", &n) != 1
+					|| !snow_set_line_length (ctx, n)) {
 			fprintf (stderr, "Illegal line length value '%s'\n",
 								optarg);
 			errflag = TRUE;
 		    }
 		    break;
+		case 'M':
+		    if (argv[optind][2] != '\0')
+			optarg = &argv[optind][2];
+		    else if (++optind == argc) {
+			errflag = TRUE;
+			break;
+		    } else
+			optarg = argv[optind];
+
+		    if (strcmp (optarg, "cfb") == 0)
+			snow_set_cipher_mode (ctx, SNOW_CIPHER_CFB);
+		    else if (strcmp (optarg, "ctr") == 0)
+			snow_set_cipher_mode (ctx, SNOW_CIPHER_CTR);
+		    else {
+			fprintf (stderr, "Illegal cipher mode '%s'\n", optarg);
+			errflag = TRUE;
+		    }
+		    break;
 		case 'm':
 		    if (argv[optind][2] != '\0')
 			optarg = &argv[optind][2];
@@ -242,6 +311,35 @@ main (
 
 		    message_string = optarg;
 		    break;
+		case 't':
+		    if (argv[optind][2] != '\0')
+			optarg = &argv[optind][2];
+		    else if (++optind == argc) {
+			errflag = TRUE;
+			break;
+		    } else
+			optarg = argv[optind];
+
+		    if (!snow_set_carriers (ctx, carriers_parse (optarg))) {
+			fprintf (stderr, "Illegal carrier list '%s'\n", optarg);
+			errflag = TRUE;
+		    }
+		    break;
+		case 'X':
+		    if (argv[optind][2] != '\0')
+			optarg = &argv[optind][2];
+		    else if (++optind == argc) {
+			errflag = TRUE;
+			break;
+		    } else
+			optarg = argv[optind];
+
+		    if (sscanf (optarg, "%d", &n) != 1 || n <= 0
+				|| !snow_set_chunk_size (ctx, (size_t) n)) {
+			fprintf (stderr, "Illegal chunk size '%s'\n", optarg);
+			errflag = TRUE;
+		    }
+		    break;
 		case 'p':
 		    if (argv[optind][2] != '\0')
 			optarg = &argv[optind][2];
@@ -268,16 +366,44 @@ main (
 	    errflag = TRUE;
 	}
 
+	if (range_flag && (space_flag || inplace_flag || append_flag
+			|| message_string != NULL || message_fp != NULL)) {
+	    fprintf (stderr, "The --range option is only for extracting\n");
+	    errflag = TRUE;
+	}
+
+	if (inplace_flag && (space_flag || (message_string == NULL
+						&& message_fp == NULL))) {
+	    fprintf (stderr, "The -i option needs a message to conceal\n");
+	    errflag = TRUE;
+	} else if (inplace_flag && optind != argc - 1) {
+	    fprintf (stderr, "The -i option needs exactly one file\n");
+	    errflag = TRUE;
+	}
+
+	if (append_flag && inplace_flag) {
+	    fprintf (stderr, "Cannot specify both -a and -i\n");
+	    errflag = TRUE;
+	} else if (append_flag && (space_flag || (message_string == NULL
+						&& message_fp == NULL))) {
+	    fprintf (stderr, "The -a option needs a message to append\n");
+	    errflag = TRUE;
+	} else if (append_flag && optind != argc - 1) {
+	    fprintf (stderr, "The -a option needs exactly one file\n");
+	    errflag = TRUE;
+	}
+
 	if (errflag || optind < argc - 2) {
 	    showUsage (argv[0]);
 	    return 1;
 	}
 
 	if (passwd != NULL)
-	    password_set (passwd);
+	    snow_set_password (ctx, passwd);
 
 	if (optind < argc) {
-	    if ((infile = fopen (argv[optind], "r")) == NULL) {
+	    if ((infile = fopen (argv[optind], (inplace_flag || append_flag)
+							? "r+" : "r")) == NULL) {
 		perror (argv[optind]);
 		return 1;
 	    }
@@ -291,19 +417,42 @@ main (
 	}
 
 	if (space_flag) {
-	    space_calculate (infile);
+	    snow_space (ctx, infile);
+	} else if (append_flag && message_string != NULL) {
+	    if (!snow_append (ctx, message_string, strlen (message_string),
+								infile))
+		return 1;
+	} else if (append_flag) {
+	    if (!snow_append_file (ctx, message_fp, infile))
+		return 1;
+	    fclose (message_fp);
+	} else if (inplace_flag && message_string != NULL) {
+	    if (!snow_encode_inplace (ctx, message_string,
+					strlen (message_string), infile))
+		return 1;
+	} else if (inplace_flag) {
+	    if (!snow_encode_file_inplace (ctx, message_fp, infile))
+		return 1;
+	    fclose (message_fp);
 	} else if (message_string != NULL) {
-	    if (!message_string_encode (message_string, infile, outfile))
+	    if (!snow_encode (ctx, message_string, strlen (message_string),
+							infile, outfile))
 		return 1;
 	} else if (message_fp != NULL) {
-	    if (!message_fp_encode (message_fp, infile, outfile))
+	    if (!snow_encode_file (ctx, message_fp, infile, outfile))
 		return 1;
 	    fclose (message_fp);
+	} else if (range_flag) {
+	    if (!snow_extract_range (ctx, infile, outfile, range_off,
+								range_len))
+		return 1;
 	} else {
-	    if (!message_extract (infile, outfile))
+	    if (!snow_extract (ctx, infile, outfile))
 		return 1;
 	}
 
+	snow_ctx_destroy (ctx);
+
 	if (outfile != stdout)
 	    fclose (outfile);
 	if (infile != stdout)
@@ -0,0 +1,119 @@
+/*
+ * Thread support routines for the SNOW steganography program.
+ *
+ * Copyright (C) 1999 Matthew Kwan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ *
+ * For license text, see https://spdx.org/licenses/Apache-2.0>.
+ */
+
+#include <stdlib.h>
+
+#include "snow.h"
+
+#ifndef NO_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+
+/*
+ * Structure passed to each worker thread.
+ */
+
+typedef struct {
+	void		(*func) (void *arg, int idx);
+	void		*arg;
+	int		idx;
+} PARALLEL_JOB;
+
+
+/*
+ * Return the number of threads worth running.
+ */
+
+int
+parallel_threads (void)
+{
+#if !defined (NO_THREADS) && defined (_SC_NPROCESSORS_ONLN)
+	long		n = sysconf (_SC_NPROCESSORS_ONLN);
+
+	if (n > 1)
+	    return ((n > PARALLEL_MAX) ? PARALLEL_MAX : (int) n);
+#endif
+	return (1);
+}
+
+
+#ifndef NO_THREADS
+
+/*
+ * Thread entry point.
+ */
+
+static void *
+parallel_start (
+	void		*p
+) {
+	PARALLEL_JOB	*job = (PARALLEL_JOB *) p;
+
+	job->func (job->arg, job->idx);
+
+	return (NULL);
+}
+
+#endif
+
+
+/*
+ * Call func (arg, i) for each i from 0 to n-1, in parallel where
+ * possible, and wait for them all to finish.
+ * If a thread can't be started its work is done in this thread.
+ */
+
+void
+parallel_run (
+	int		n,
+	void		(*func) (void *arg, int idx),
+	void		*arg
+) {
+#ifndef NO_THREADS
+	int		i;
+	int		nt = (n > PARALLEL_MAX) ? PARALLEL_MAX : n;
+	pthread_t	tid[PARALLEL_MAX];
+	BOOL		started[PARALLEL_MAX];
+	PARALLEL_JOB	job[PARALLEL_MAX];
+
+	for (i=1; i<nt; i++) {
+	    job[i].func = func;
+	    job[i].arg = arg;
+	    job[i].idx = i;
+	    started[i] = (pthread_create (&tid[i], NULL, parallel_start,
+							&job[i]) == 0);
+	}
+
+	for (i=0; i<n; i++)
+	    if (i == 0 || i >= nt)
+		func (arg, i);
+
+	for (i=1; i<nt; i++) {
+	    if (started[i])
+		pthread_join (tid[i], NULL);
+	    else
+		func (arg, i);
+	}
+#else
+	int		i;
+
+	for (i=0; i<n; i++)
+	    func (arg, i);
+#endif
+}
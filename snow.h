@@ -19,6 +19,10 @@
 #define _SNOW_H
 
 #include <stdio.h>
+#include <stdint.h>
+
+
+#include "libsnow.h"
 
 
 /*
@@ -37,40 +41,356 @@ typedef int	BOOL;
 
 
 /*
- * Define global variables.
+ * Cipher modes.
+ */
+
+#define CIPHER_CFB	SNOW_CIPHER_CFB
+#define CIPHER_CTR	SNOW_CIPHER_CTR
+
+
+/*
+ * Carriers.
+ */
+
+#define CARRIER_WS	SNOW_CARRIER_WS
+#define CARRIER_ZW	SNOW_CARRIER_ZW
+#define CARRIER_EOL	SNOW_CARRIER_EOL
+
+
+/*
+ * The maximum number of threads used by the parallel routines.
+ */
+
+#define PARALLEL_MAX	64
+
+
+/*
+ * The number of counter mode blocks encrypted at a time.
+ */
+
+#define CTR_BATCH	64
+
+
+/*
+ * Whether a message will fit in the text, as found by encode_plan().
+ */
+
+#define PLAN_FITS		0
+#define PLAN_MAY_NOT_FIT	1	/* Depends on the data */
+#define PLAN_WONT_FIT		2
+
+
+/*
+ * The longest line the dense encoding's header can describe.
+ */
+
+#define DENSE_LINE_MAX		0xffffff
+
+
+/*
+ * Where a chunk of an indexed message starts: the offset in bytes of
+ * the line holding its first bit from the first dense line, and the
+ * number of bits in that line before it.
+ */
+
+typedef struct {
+	uint64_t	offset;
+	unsigned long	bits;
+} SNOW_CHUNK;
+
+
+/*
+ * Where more data can be appended to a concealed message, as found by
+ * message_locate(). A message with a length header gets another segment
+ * from the line after its last one. Otherwise the line holding its end
+ * is rewritten, with the bits it already held from the first tab on.
  */
 
-extern BOOL	compress_flag;
-extern BOOL	quiet_flag;
-extern int	line_length;
+typedef struct {
+	size_t		pos;		/* Where the text to rewrite starts */
+	uint64_t	iv;		/* The CFB IV to carry on with */
+	BOOL		segment;	/* Start a segment, with a header */
+	BOOL		first_tab;	/* The first tab comes before pos */
+	unsigned char	*bits;		/* Bits to write back at pos */
+	unsigned long	nbits;
+	unsigned long	size;
+} SNOW_APPEND;
+
+
+/*
+ * The state of an encoding or extraction. Every routine that needs
+ * state takes the context as its first argument.
+ */
+
+struct snow_ctx_struct {
+	/* Settings */
+	BOOL		compress_flag;
+	BOOL		quiet_flag;
+	int		line_length;
+	int		ice_level;
+	int		cipher_mode;
+	BOOL		cipher_mode_set;	/* Chosen rather than the default */
+	int		threads;
+	BOOL		header_flag;
+	BOOL		strict_flag;	/* Refuse messages that don't fit */
+	BOOL		append_plain;	/* Old messages without headers are
+					   known to be uncompressed */
+	BOOL		dense_flag;	/* Use the dense encoding */
+	int		carriers;	/* Carriers used by dense lines */
+	unsigned long	chunk_size;	/* Bytes per indexed chunk, or 0 */
+
+	/* Compression */
+	int		compress_bit_count;
+	int		compress_value;
+	uint64_t	compress_acc;
+	int		compress_acc_bits;
+	unsigned long	compress_bits_in;
+	unsigned long	compress_bits_out;
+
+	/* Uncompression and output */
+	int		output_bit_count;
+	int		output_value;
+	BOOL		uncompress_flag;
+	uint64_t	uncompress_acc;
+	int		uncompress_acc_bits;
+
+	/* Encryption. In counter mode the counter starts at the random
+	 * nonce in the header, and each encrypted block provides 64 bits
+	 * of keystream. Blocks of keystream are generated in batches.
+	 */
+	struct ice_key_struct	*ice_key;
+	uint64_t	encrypt_iv;
+	uint64_t	encrypt_iv_start;
+	int		encrypt_mode;
+	BOOL		encrypt_header_pending;
+	uint64_t	encrypt_ctr;
+	uint64_t	encrypt_nonce;
+	uint64_t	encrypt_tail;	/* The last 64 bits of ciphertext */
+	uint64_t	encrypt_ks;
+	int		encrypt_ks_bits;
+	unsigned char	encrypt_ks_blocks[CTR_BATCH][8];
+	int		encrypt_ks_next;
+
+	/* Data held back until its length is known, for the header */
+	unsigned char	*encrypt_hold;
+	unsigned long	encrypt_hold_size;
+	unsigned long	encrypt_hold_bits;
+
+	/* The chunk index of a message, giving where each chunk after the
+	 * first starts. Dense lines start at a fixed line after the header,
+	 * and counter mode starts at the nonce, so neither depends on it.
+	 */
+	SNOW_CHUNK	*index;
+	unsigned long	index_count;
+	unsigned long	index_size;
+	unsigned long	index_chunk;	/* Bytes per chunk, or 0 if none */
+	uint64_t	index_line;	/* The first dense line */
+	uint64_t	index_ctr;	/* The data's first counter */
+
+	/* Reading the header during decryption */
+	BOOL		decrypt_header_reading;
+	uint64_t	decrypt_header_raw;
+	uint64_t	decrypt_header_value;
+	int		decrypt_header_bits;
+	int		decrypt_header_size;
+	int		decrypt_header_fixed;	/* Where the nonce starts */
+	int		decrypt_header_nonce;	/* Its size, or 0 if none */
+	int		decrypt_header_flags;
+
+	/* Set once a header has been read saying the lines are dense */
+	BOOL		decode_dense;
+	int		decode_carriers;
+
+	/* The data length, if given by the header. Once that much has been
+	 * read, another segment may have been appended, starting on the next
+	 * line with a header of its own, in 1-bit CFB mode carrying on from
+	 * the last 64 bits of ciphertext before it.
+	 */
+	BOOL		decrypt_length_known;
+	uint64_t	decrypt_length;
+	BOOL		decrypt_done;
+	BOOL		decrypt_last;	/* No further segment follows */
+	unsigned long	decrypt_segments;	/* Segments read so far */
+	uint64_t	decrypt_iv;	/* The IV the segment started with */
+	uint64_t	decrypt_tail;	/* The last 64 bits of ciphertext */
+
+	/* Ciphertext collected during decryption, so the keystream can
+	 * be calculated in parallel once all of it is known.
+	 */
+	unsigned char	*decrypt_buf;
+	unsigned long	decrypt_buf_size;
+	unsigned long	decrypt_buf_bits;
+
+	/* Encoding */
+	int		encode_bit_count;
+	uint64_t	encode_value;
+	char		*encode_buffer;
+	size_t		encode_buffer_size;
+	BOOL		encode_buffer_loaded;
+	int		encode_buffer_length;
+	int		encode_buffer_column;
+	BOOL		encode_first_tab;
+	BOOL		encode_needs_tab;
+	unsigned long	encode_bits_used;
+	unsigned long	encode_bits_available;
+	unsigned long	encode_lines_extra;
+	uint64_t	encode_lines;	/* Lines loaded so far */
+	int		encode_line_bits;	/* Bits in the loaded line */
+	BOOL		encode_inplace;	/* Leave the rest of the text unread */
+	BOOL		encode_dense;	/* The header is written, lines are dense */
+	int		encode_dense_stage;	/* Carrier being filled */
+	int		encode_dense_unit;	/* Bits it takes next */
+
+	/* Capacity planning, with a table entry per column per state */
+	int		*plan_min;
+	int		*plan_max;
+	int		plan_length;
+
+	/* The dense encoding, with the number of runs of whitespace that
+	 * fit after each column, and the bits a line ending there holds.
+	 */
+	uint64_t	*dense_count;
+	int		*dense_bits;
+	int		dense_length;
+};
+
+
+/*
+ * An input stream, reading from a file or from memory.
+ */
+
+typedef struct {
+	FILE		*fp;
+	const char	*buf;
+	size_t		len;
+	size_t		pos;
+	void		*map;		/* Memory mapping, if any */
+	size_t		map_len;
+	int		map_fd;		/* The file that is mapped */
+} SNOW_READER;
+
+
+/*
+ * An output stream, writing to a file through a fixed buffer,
+ * or to a growable buffer.
+ */
+
+typedef struct {
+	FILE		*fp;
+	char		*buf;
+	size_t		len;		/* Bytes held in the buffer */
+	size_t		size;
+	BOOL		hold;		/* Keep everything in the buffer */
+} SNOW_WRITER;
 
 
 /*
  * Define external functions.
+ * Functions taking a bits/nbits pair consume the lowest nbits (at most 64)
+ * of the value, most significant bit first.
  */
 
-extern void	password_set (const char *passwd);
-extern BOOL	message_extract (FILE *inf, FILE *outf);
-extern void	space_calculate (FILE *inf);
+extern void	password_set (SNOW_CTX *ctx, const char *passwd);
+extern BOOL	message_extract (SNOW_CTX *ctx, SNOW_READER *inf,
+							SNOW_WRITER *outf);
+extern BOOL	message_extract_range (SNOW_CTX *ctx, SNOW_READER *inf,
+				SNOW_WRITER *outf, uint64_t off, uint64_t len);
+extern BOOL	message_locate (SNOW_CTX *ctx, const SNOW_READER *r,
+							SNOW_APPEND *ap);
+extern void	space_calculate (SNOW_CTX *ctx, SNOW_READER *inf);
+
+extern int	parallel_threads (void);
+extern void	parallel_run (int n, void (*func) (void *arg, int idx),
+								void *arg);
+
+extern void	reader_file_init (SNOW_READER *r, FILE *fp);
+extern void	reader_mem_init (SNOW_READER *r, const char *buf, size_t len);
+extern BOOL	reader_map_init (SNOW_READER *r, FILE *fp);
+extern BOOL	reader_map_seek (SNOW_READER *r, FILE *fp);
+extern void	reader_close (SNOW_READER *r);
+extern char	*reader_getline (SNOW_READER *r, char **buf, size_t *size,
+							size_t *len);
+extern void	writer_file_init (SNOW_WRITER *w, FILE *fp);
+extern void	writer_mem_init (SNOW_WRITER *w);
+extern BOOL	writer_write (SNOW_WRITER *w, const char *buf, size_t len);
+extern BOOL	writer_putc (SNOW_WRITER *w, int c);
+extern BOOL	writer_flush (SNOW_WRITER *w);
+extern BOOL	writer_close (SNOW_WRITER *w);
+extern BOOL	writer_copy (SNOW_WRITER *w, const SNOW_READER *r,
+						size_t pos, size_t len);
+extern BOOL	file_replace (FILE *fp, size_t start, const char *buf,
+								size_t len);
+extern BOOL	bitbuf_append (unsigned char **buf, unsigned long *size,
+				unsigned long *nbits, uint64_t bits, int n);
+extern uint64_t	bitbuf_get (const unsigned char *buf, unsigned long pos,
+								int n);
 
-extern void	compress_init (void);
-extern BOOL	compress_bit (int bit, FILE *inf, FILE *outf);
-extern BOOL	compress_flush (FILE *inf, FILE *outf);
+extern void	compress_init (SNOW_CTX *ctx);
+extern unsigned long	compress_size (SNOW_CTX *ctx,
+				const unsigned char *buf, size_t n);
+extern BOOL	compress_bytes (SNOW_CTX *ctx, const unsigned char *buf,
+				size_t n, SNOW_READER *inf, SNOW_WRITER *outf);
+extern BOOL	compress_bit (SNOW_CTX *ctx, int bit, SNOW_READER *inf,
+							SNOW_WRITER *outf);
+extern BOOL	compress_flush (SNOW_CTX *ctx, SNOW_READER *inf,
+							SNOW_WRITER *outf);
 
-extern void	uncompress_init (void);
-extern BOOL	uncompress_bit (int bit, FILE *outf);
-extern BOOL	uncompress_flush (FILE *outf);
+extern void	uncompress_init (SNOW_CTX *ctx);
+extern BOOL	uncompress_bits (SNOW_CTX *ctx, uint64_t bits, int nbits,
+							SNOW_WRITER *outf);
+extern BOOL	uncompress_bit (SNOW_CTX *ctx, int bit, SNOW_WRITER *outf);
+extern BOOL	uncompress_flush (SNOW_CTX *ctx);
 
-extern void	encrypt_init (void);
-extern BOOL	encrypt_bit (int bit, FILE *inf, FILE *outf);
-extern BOOL	encrypt_flush (FILE *inf, FILE *outf);
+extern int	cipher_mode_used (SNOW_CTX *ctx);
+extern void	encrypt_init (SNOW_CTX *ctx);
+extern int	encrypt_header_size (SNOW_CTX *ctx);
+extern BOOL	encrypt_bytes (SNOW_CTX *ctx, const unsigned char *buf,
+				size_t n, SNOW_READER *inf, SNOW_WRITER *outf);
+extern BOOL	encrypt_bits (SNOW_CTX *ctx, uint64_t bits, int nbits,
+					SNOW_READER *inf, SNOW_WRITER *outf);
+extern BOOL	encrypt_bit (SNOW_CTX *ctx, int bit, SNOW_READER *inf,
+							SNOW_WRITER *outf);
+extern BOOL	index_append (SNOW_CTX *ctx, uint64_t offset,
+							unsigned long bits);
+extern BOOL	encrypt_header (SNOW_CTX *ctx, SNOW_READER *inf,
+							SNOW_WRITER *outf);
+extern BOOL	encrypt_flush (SNOW_CTX *ctx, SNOW_READER *inf,
+							SNOW_WRITER *outf);
+extern void	encrypt_destroy (SNOW_CTX *ctx);
 
-extern void	decrypt_init (void);
-extern BOOL	decrypt_bit (int bit, FILE *outf);
-extern BOOL	decrypt_flush (FILE *outf);
+extern void	decrypt_init (SNOW_CTX *ctx);
+extern BOOL	decrypt_bits (SNOW_CTX *ctx, uint64_t bits, int nbits,
+							SNOW_WRITER *outf);
+extern BOOL	decrypt_bit (SNOW_CTX *ctx, int bit, SNOW_WRITER *outf);
+extern BOOL	decrypt_flush (SNOW_CTX *ctx, SNOW_WRITER *outf);
+extern BOOL	decrypt_next (SNOW_CTX *ctx, SNOW_WRITER *outf);
+extern void	decrypt_stop (SNOW_CTX *ctx);
+extern void	decrypt_chunks (SNOW_CTX *ctx, unsigned char *buf,
+				unsigned long nbits, unsigned long chunk);
 
-extern void	encode_init (void);
-extern BOOL	encode_bit (int bit, FILE *inf, FILE *outf);
-extern BOOL	encode_flush (FILE *inf, FILE *outf);
+extern BOOL	dense_init (SNOW_CTX *ctx, int len);
+extern BOOL	dense_used (SNOW_CTX *ctx);
+extern BOOL	encode_dense_parallel (SNOW_CTX *ctx,
+			const unsigned char *buf, unsigned long nbits,
+			SNOW_READER *inf, SNOW_WRITER *outf, int nthreads);
+extern BOOL	encode_dense_indexed (SNOW_CTX *ctx,
+			const unsigned char *buf, unsigned long nbits,
+			SNOW_READER *inf, SNOW_WRITER *outf);
+extern int	encode_plan (SNOW_CTX *ctx, const SNOW_READER *r,
+			unsigned long bits, unsigned long *lo,
+			unsigned long *hi);
+extern void	encode_init (SNOW_CTX *ctx);
+extern void	encode_destroy (SNOW_CTX *ctx);
+extern BOOL	encode_bits (SNOW_CTX *ctx, uint64_t bits, int nbits,
+					SNOW_READER *inf, SNOW_WRITER *outf);
+extern BOOL	encode_bit (SNOW_CTX *ctx, int bit, SNOW_READER *inf,
+							SNOW_WRITER *outf);
+extern BOOL	encode_flush (SNOW_CTX *ctx, SNOW_READER *inf,
+							SNOW_WRITER *outf);
+extern BOOL	encode_segment_end (SNOW_CTX *ctx, SNOW_READER *inf,
+							SNOW_WRITER *outf);
+extern BOOL	encode_dense_start (SNOW_CTX *ctx, SNOW_WRITER *outf);
+extern BOOL	encode_resume (SNOW_CTX *ctx, const SNOW_APPEND *ap,
+				SNOW_READER *inf, SNOW_WRITER *outf);
 
 #endif
@@ -0,0 +1,698 @@
+/*
+ * Input and output streams for the SNOW steganography program.
+ * A stream is either a stdio file or a buffer in memory.
+ *
+ * Copyright (C) 1999 Matthew Kwan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ *
+ * For license text, see https://spdx.org/licenses/Apache-2.0>.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* For copy_file_range */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "snow.h"
+
+#if (defined (unix) || defined (__unix__) || defined (__APPLE__)) \
+						&& !defined (NO_MMAP)
+#define HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#if defined (unix) || defined (__unix__) || defined (__APPLE__)
+#define HAVE_WRITEV
+#define HAVE_PWRITE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined (__linux__) && defined (HAVE_MMAP)
+#define HAVE_COPY_FILE_RANGE
+#include <sys/sendfile.h>
+#endif
+
+#define WRITER_BUFSIZ	(256 * 1024)	/* Size of a file writer's buffer */
+#define WRITER_ALIGN	4096
+#define WRITER_COPY_MIN	WRITER_BUFSIZ	/* Smallest copy done by the kernel */
+#define SHIFT_BUFSIZ	(1024 * 1024)	/* Buffer for moving text in a file */
+
+
+/*
+ * Read from a file.
+ */
+
+void
+reader_file_init (
+	SNOW_READER	*r,
+	FILE		*fp
+) {
+	r->fp = fp;
+	r->buf = NULL;
+	r->len = 0;
+	r->pos = 0;
+	r->map = NULL;
+	r->map_len = 0;
+	r->map_fd = -1;
+}
+
+
+/*
+ * Read from a buffer in memory.
+ */
+
+void
+reader_mem_init (
+	SNOW_READER	*r,
+	const char	*buf,
+	size_t		len
+) {
+	r->fp = NULL;
+	r->buf = buf;
+	r->len = len;
+	r->pos = 0;
+	r->map = NULL;
+	r->map_len = 0;
+	r->map_fd = -1;
+}
+
+
+/*
+ * Read from a file by mapping it into memory, starting at its
+ * current position. Returns FALSE if the file can't be mapped, in
+ * which case it is read with stdio instead.
+ */
+
+BOOL
+reader_map_init (
+	SNOW_READER	*r,
+	FILE		*fp
+) {
+#ifdef HAVE_MMAP
+	struct stat	st;
+	off_t		off;
+	void		*p;
+
+	reader_file_init (r, fp);
+
+	if (fstat (fileno (fp), &st) != 0 || !S_ISREG (st.st_mode)
+		|| st.st_size == 0 || (off = ftello (fp)) < 0
+		|| off > st.st_size || (uintmax_t) st.st_size > SIZE_MAX)
+	    return (FALSE);
+
+	p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno (fp), 0);
+	if (p == MAP_FAILED)
+	    return (FALSE);
+
+#ifdef MADV_SEQUENTIAL
+	madvise (p, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+	reader_mem_init (r, (const char *) p, st.st_size);
+	r->pos = off;
+	r->map = p;
+	r->map_len = st.st_size;
+	r->map_fd = fileno (fp);
+
+	return (TRUE);
+#else
+	reader_file_init (r, fp);
+
+	return (FALSE);
+#endif
+}
+
+
+/*
+ * Move the file fp, mapped by reader_map_init, to the position the
+ * reader has reached, so reading can carry on with stdio.
+ * Returns FALSE if the file can't be moved.
+ */
+
+BOOL
+reader_map_seek (
+	SNOW_READER	*r,
+	FILE		*fp
+) {
+#ifdef HAVE_MMAP
+	if (r->map != NULL)
+	    return (fseeko (fp, (off_t) r->pos, SEEK_SET) == 0);
+#endif
+	return (TRUE);
+}
+
+
+/*
+ * Release anything held by a reader.
+ */
+
+void
+reader_close (
+	SNOW_READER	*r
+) {
+#ifdef HAVE_MMAP
+	if (r->map != NULL)
+	    munmap (r->map, r->map_len);
+#endif
+	r->map = NULL;
+	r->map_len = 0;
+	r->map_fd = -1;
+}
+
+
+/*
+ * Grow a line buffer to the size given.
+ */
+
+static BOOL
+line_grow (
+	char		**buf,
+	size_t		*size,
+	size_t		newsize
+) {
+	char		*p;
+
+	if ((p = (char *) realloc (*buf, newsize)) == NULL) {
+	    fprintf (stderr, "Error: out of memory\n");
+	    return (FALSE);
+	}
+
+	*buf = p;
+	*size = newsize;
+
+	return (TRUE);
+}
+
+
+/*
+ * Read a whole line of text, however long, into a buffer which is
+ * grown as needed. The buffer may start out NULL, and should be
+ * reused for each line so that it rarely needs to grow. As with
+ * fgets, the line keeps its newline and ends with a null, and its
+ * length is returned in len.
+ * Returns NULL at the end of the input, or if out of memory.
+ */
+
+char *
+reader_getline (
+	SNOW_READER	*r,
+	char		**buf,
+	size_t		*size,
+	size_t		*len
+) {
+	size_t		n = 0;
+
+	if ((*buf == NULL || *size < 2) && !line_grow (buf, size, BUFSIZ))
+	    return (NULL);
+
+	if (r->fp == NULL) {
+	    const char	*s, *nl;
+
+	    if (r->pos >= r->len)
+		return (NULL);
+
+	    s = r->buf + r->pos;
+	    n = r->len - r->pos;
+	    if ((nl = (const char *) memchr (s, '\n', n)) != NULL)
+		n = nl - s + 1;
+
+	    if (n + 1 > *size && !line_grow (buf, size, n + 1))
+		return (NULL);
+
+	    memcpy (*buf, s, n);
+	    (*buf)[n] = '\0';
+	    r->pos += n;
+	    *len = n;
+
+	    return (*buf);
+	}
+
+	for (;;) {
+			/* fgets only writes the last byte if it fills the buffer */
+	    (*buf)[*size - 1] = 1;
+	    if (fgets (*buf + n, *size - n, r->fp) == NULL) {
+		*len = n;
+		return ((n > 0) ? *buf : NULL);
+	    }
+
+	    if ((*buf)[*size - 1] != '\0' || (*buf)[*size - 2] == '\n') {
+		*len = n + strlen (*buf + n);
+		return (*buf);
+	    }
+
+	    n = *size - 1;
+	    if (!line_grow (buf, size, *size * 2))
+		return (NULL);
+	}
+}
+
+
+/*
+ * Write to a file. Output is gathered in a large buffer and written
+ * to the file's descriptor in blocks, bypassing stdio, so the writer
+ * must be closed with writer_close. If the buffer can't be allocated,
+ * every write goes straight to the file.
+ */
+
+void
+writer_file_init (
+	SNOW_WRITER	*w,
+	FILE		*fp
+) {
+	void		*p = NULL;
+
+	w->fp = fp;
+	w->buf = NULL;
+	w->len = 0;
+	w->size = 0;
+	w->hold = FALSE;
+
+	fflush (fp);		/* Anything stdio holds must go first */
+
+#ifdef HAVE_WRITEV
+	if (posix_memalign (&p, WRITER_ALIGN, WRITER_BUFSIZ) != 0)
+	    p = NULL;
+#else
+	p = malloc (WRITER_BUFSIZ);
+#endif
+	if (p != NULL) {
+	    w->buf = (char *) p;
+	    w->size = WRITER_BUFSIZ;
+	}
+}
+
+
+/*
+ * Write to a buffer in memory, which grows as needed.
+ * The buffer belongs to the caller once writing is done.
+ */
+
+void
+writer_mem_init (
+	SNOW_WRITER	*w
+) {
+	w->fp = NULL;
+	w->buf = NULL;
+	w->len = 0;
+	w->size = 0;
+	w->hold = FALSE;
+}
+
+
+/*
+ * Write two buffers to a writer's file, in as few calls as possible.
+ * Returns FALSE if the write fails, with errno set.
+ */
+
+static BOOL
+writer_out (
+	SNOW_WRITER	*w,
+	const char	*buf1,
+	size_t		len1,
+	const char	*buf2,
+	size_t		len2
+) {
+#ifdef HAVE_WRITEV
+	struct iovec	iov[2];
+	int		i = 0, n = 0;
+	int		fd = fileno (w->fp);
+
+	if (len1 > 0) {
+	    iov[n].iov_base = (void *) buf1;
+	    iov[n++].iov_len = len1;
+	}
+	if (len2 > 0) {
+	    iov[n].iov_base = (void *) buf2;
+	    iov[n++].iov_len = len2;
+	}
+
+	while (i < n) {
+	    ssize_t	k = writev (fd, iov + i, n - i);
+
+	    if (k < 0) {
+		if (errno == EINTR)
+		    continue;
+		return (FALSE);
+	    }
+
+			/* Skip what was written, after a partial write */
+	    while (i < n && (size_t) k >= iov[i].iov_len)
+		k -= iov[i++].iov_len;
+	    if (i < n) {
+		iov[i].iov_base = (char *) iov[i].iov_base + k;
+		iov[i].iov_len -= k;
+	    }
+	}
+
+	return (TRUE);
+#else
+	return (fwrite (buf1, sizeof (char), len1, w->fp) == len1
+			&& fwrite (buf2, sizeof (char), len2, w->fp) == len2);
+#endif
+}
+
+
+/*
+ * Write a number of bytes. Returns FALSE if the write fails,
+ * with errno set. While a file writer is holding its output, its
+ * buffer grows like a memory writer's.
+ */
+
+BOOL
+writer_write (
+	SNOW_WRITER	*w,
+	const char	*buf,
+	size_t		len
+) {
+	if (len == 0)
+	    return (TRUE);
+
+	if (w->fp != NULL && !w->hold) {
+	    size_t	n = w->size - w->len;
+
+	    if (len <= n && w->buf != NULL) {
+		memcpy (w->buf + w->len, buf, len);
+		w->len += len;
+		return (TRUE);
+	    }
+
+			/* Keep the writes in whole blocks where possible */
+	    if (len < w->size) {
+		memcpy (w->buf + w->len, buf, n);
+		if (!writer_out (w, w->buf, w->size, NULL, 0))
+		    return (FALSE);
+		memcpy (w->buf, buf + n, len - n);
+		w->len = len - n;
+		return (TRUE);
+	    }
+
+	    n = w->len;
+	    w->len = 0;
+
+	    return (writer_out (w, w->buf, n, buf, len));
+	}
+
+	if (w->len + len > w->size) {
+	    size_t	size = w->size * 2 + BUFSIZ;
+	    char	*p;
+
+	    if (size < w->len + len)
+		size = w->len + len;
+	    if ((p = (char *) realloc (w->buf, size)) == NULL)
+		return (FALSE);
+
+	    w->buf = p;
+	    w->size = size;
+	}
+
+	memcpy (w->buf + w->len, buf, len);
+	w->len += len;
+
+	return (TRUE);
+}
+
+
+/*
+ * Write a single byte.
+ */
+
+BOOL
+writer_putc (
+	SNOW_WRITER	*w,
+	int		c
+) {
+	char		ch = c;
+
+	if (w->len < w->size) {
+	    w->buf[w->len++] = ch;
+	    return (TRUE);
+	}
+
+	return (writer_write (w, &ch, 1));
+}
+
+
+/*
+ * Write out anything in a file writer's buffer, unless it is being held.
+ * Returns FALSE if the write fails, with errno set.
+ */
+
+BOOL
+writer_flush (
+	SNOW_WRITER	*w
+) {
+	size_t		n = w->len;
+
+	if (w->fp == NULL || n == 0 || w->hold)
+	    return (TRUE);
+
+	w->len = 0;
+
+	return (writer_out (w, w->buf, n, NULL, 0));
+}
+
+
+/*
+ * Flush a file writer and release its buffer. Output still being held
+ * is thrown away. A memory writer's buffer is left for the caller.
+ */
+
+BOOL
+writer_close (
+	SNOW_WRITER	*w
+) {
+	BOOL		ok;
+
+	if (w->fp == NULL)
+	    return (TRUE);
+
+	if (w->hold)
+	    w->len = 0;
+
+	ok = writer_flush (w);
+	free (w->buf);
+	w->buf = NULL;
+	w->size = 0;
+
+	return (ok);
+}
+
+
+/*
+ * Write len bytes of a reader's text, starting at pos, without
+ * changing them. Large stretches of a mapped file going to a file
+ * are copied by the kernel rather than through memory, falling back
+ * to sendfile and then to an ordinary write if that isn't possible.
+ */
+
+BOOL
+writer_copy (
+	SNOW_WRITER		*w,
+	const SNOW_READER	*r,
+	size_t			pos,
+	size_t			len
+) {
+#ifdef HAVE_COPY_FILE_RANGE
+	if (r->map_fd >= 0 && w->fp != NULL && !w->hold
+						&& len >= WRITER_COPY_MIN) {
+	    int		fd = fileno (w->fp);
+	    off_t	off = pos;
+	    BOOL	use_copy = TRUE;
+	    ssize_t	n;
+
+	    if (!writer_flush (w))
+		return (FALSE);
+
+	    while (len > 0) {
+		if (use_copy && (n = copy_file_range (r->map_fd, &off, fd,
+							NULL, len, 0)) <= 0)
+		    use_copy = FALSE;
+		if (!use_copy && (n = sendfile (fd, r->map_fd, &off, len)) <= 0)
+		    break;
+
+		len -= n;
+	    }
+
+	    pos = off;
+	}
+#endif
+
+	return (writer_write (w, r->buf + pos, len));
+}
+
+
+#ifdef HAVE_PWRITE
+
+/*
+ * Read or write exactly len bytes at an offset in a file.
+ * Returns FALSE if that fails, with errno set.
+ */
+
+static BOOL
+file_io (
+	int		fd,
+	char		*buf,
+	size_t		len,
+	off_t		off,
+	BOOL		write_flag
+) {
+	while (len > 0) {
+	    ssize_t	n = write_flag ? pwrite (fd, buf, len, off)
+					: pread (fd, buf, len, off);
+
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n <= 0) {
+		if (n == 0)
+		    errno = EIO;
+		return (FALSE);
+	    }
+
+	    buf += n;
+	    len -= n;
+	    off += n;
+	}
+
+	return (TRUE);
+}
+
+#endif
+
+
+/*
+ * Replace the part of a file from start up to where it has been read
+ * with len bytes from buf, moving the rest of the file up or down to
+ * make room. The rest is moved through a bounded buffer, starting from
+ * whichever end keeps it from overwriting itself, and is left untouched
+ * if the new text is the same length as the old.
+ * Returns FALSE if that fails, with errno set.
+ */
+
+BOOL
+file_replace (
+	FILE		*fp,
+	size_t		start,
+	const char	*buf,
+	size_t		len
+) {
+#ifdef HAVE_PWRITE
+	int		fd = fileno (fp);
+	struct stat	st;
+	off_t		old_len, new_len = (off_t) (start + len), pos;
+	char		*tmp = NULL;
+	BOOL		ok = TRUE;
+
+	if ((old_len = ftello (fp)) < (off_t) start || fstat (fd, &st) != 0)
+	    return (FALSE);
+
+	if (new_len != old_len && st.st_size > old_len) {
+	    if ((tmp = (char *) malloc (SHIFT_BUFSIZ)) == NULL)
+		return (FALSE);
+
+	    if (new_len > old_len) {
+		for (pos = st.st_size; ok && pos > old_len;) {
+		    size_t	n = (pos - old_len < SHIFT_BUFSIZ)
+					? (size_t) (pos - old_len) : SHIFT_BUFSIZ;
+
+		    pos -= n;
+		    ok = file_io (fd, tmp, n, pos, FALSE) && file_io (fd, tmp,
+					n, pos + new_len - old_len, TRUE);
+		}
+	    } else {
+		for (pos = old_len; ok && pos < st.st_size; pos += SHIFT_BUFSIZ) {
+		    size_t	n = (st.st_size - pos < SHIFT_BUFSIZ)
+				? (size_t) (st.st_size - pos) : SHIFT_BUFSIZ;
+
+		    ok = file_io (fd, tmp, n, pos, FALSE) && file_io (fd, tmp,
+					n, pos - old_len + new_len, TRUE);
+		}
+	    }
+
+	    free (tmp);
+	}
+
+	if (ok && new_len < old_len)
+	    ok = (ftruncate (fd, st.st_size - old_len + new_len) == 0);
+
+	return (ok && file_io (fd, (char *) buf, len, (off_t) start, TRUE));
+#else
+	errno = ENOSYS;
+	return (FALSE);
+#endif
+}
+
+
+/*
+ * Append a number of bits to a growable buffer of bits, which is
+ * kept zeroed beyond the bits used. Returns FALSE if out of memory.
+ */
+
+BOOL
+bitbuf_append (
+	unsigned char	**buf,
+	unsigned long	*size,
+	unsigned long	*nbits,
+	uint64_t	bits,
+	int		n
+) {
+	if (*nbits + n > *size * 8) {
+	    unsigned long	newsize = *size * 2 + BUFSIZ;
+	    unsigned char	*p;
+
+	    if ((p = (unsigned char *) realloc (*buf, newsize)) == NULL)
+		return (FALSE);
+
+	    memset (p + *size, 0, newsize - *size);
+	    *buf = p;
+	    *size = newsize;
+	}
+
+	while (n > 0) {
+	    int		free_bits = 8 - (*nbits & 7);
+	    int		k = (n < free_bits) ? n : free_bits;
+
+	    n -= k;
+	    (*buf)[*nbits >> 3] |= ((bits >> n) & ((1 << k) - 1))
+							<< (free_bits - k);
+	    *nbits += k;
+	}
+
+	return (TRUE);
+}
+
+
+/*
+ * Return n (1 to 64) bits from a buffer of bits, starting at
+ * a byte boundary, in the lowest bits of the value.
+ */
+
+uint64_t
+bitbuf_get (
+	const unsigned char	*buf,
+	unsigned long		pos,
+	int			n
+) {
+	uint64_t	bits = 0;
+	int		i;
+
+	for (i=0; i<(n + 7) / 8; i++)
+	    bits |= (uint64_t) buf[pos / 8 + i] << (56 - i * 8);
+
+	return (bits >> (64 - n));
+}
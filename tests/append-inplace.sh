@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Append a segment to a message, then conceal another in place over
+# them, and check only the last one is extracted.
+#
+# Usage: append-inplace.sh [snow]
+
+SNOW=${1:-./snow}
+TMP=${TMPDIR:-/tmp}/snow-check.$$
+status=0
+
+trap 'rm -f "$TMP" "$TMP.out"' 0
+
+check () {
+	got=`$SNOW $opts "$TMP"`
+	if [ "$got" != "$1" ]; then
+		echo "FAIL ($opts): expected \"$1\", got \"$got\""
+		status=1
+	fi
+}
+
+for opts in "" "-p secret" "-p secret -M ctr" "-D -p secret" "-C"; do
+	yes "The quick brown fox jumps over the lazy dog." | head -200 > "$TMP"
+	$SNOW -Q -H $opts -m AAAA "$TMP" "$TMP.out" && mv "$TMP.out" "$TMP"
+	$SNOW -Q -a $opts -m BBBB "$TMP"
+	check AAAABBBB
+	$SNOW -Q -i $opts -m CCCC "$TMP"
+	check CCCC
+	$SNOW -Q -a $opts -m DDDD "$TMP"
+	check CCCCDDDD
+done
+
+[ $status -eq 0 ] && echo "append-inplace: OK"
+exit $status